@@ -0,0 +1,162 @@
+#include "board.h"
+
+/*
+    aggregateWindow() runs from the ADC interrupt at every window swap, so
+    windows the main loop is too busy to read still count. It only adds
+    sums, a closed interval is copied as it is and converted to results
+    from the main loop, in aggregateReady() or aggregateReport().
+*/
+
+#define AGG_3S_CYCLES_50HZ 150
+#define AGG_3S_CYCLES_60HZ 180
+#define AGG_SLOT_MS     600000  // 10 minutes
+#define AGG_2H_SLOTS    12
+
+struct aggInterval {
+  struct pfSums s;
+  uint64_t time;        // us
+  uint32_t cycles;
+  uint32_t windows;
+  uint32_t flagged;
+  int32_t  Upp, Ipp;
+};
+
+struct aggResults aggResults[AGG_LEVELS];
+
+static struct aggInterval interval[AGG_LEVELS];
+static struct aggInterval closed[AGG_LEVELS];   // waiting for aggConvert()
+static uint32_t closedEnd[AGG_LEVELS];          // millis() at the close
+static uint32_t aggSlot;
+static uint8_t  aggReady;
+static uint8_t  aggFresh;       // levels in closed[] not yet converted
+
+static void aggAdd(struct aggInterval *a, const struct aggInterval *b)
+{
+  a->s.sumU2 += b->s.sumU2;
+  a->s.sumI2 += b->s.sumI2;
+  a->s.sumUI += b->s.sumUI;
+  a->s.sumUqI += b->s.sumUqI;
+  a->s.samples += b->s.samples;
+  a->time += b->time;
+  a->cycles += b->cycles;
+  a->windows += b->windows;
+  a->flagged += b->flagged;
+  a->Upp = max(a->Upp, b->Upp);
+  a->Ipp = max(a->Ipp, b->Ipp);
+}
+
+static void aggClose(uint8_t level)
+{
+  struct aggInterval *a = &interval[level];
+
+  if (!a->s.samples) {
+    return;
+  }
+  closed[level] = *a;
+  closedEnd[level] = millis();
+  memset(a, 0, sizeof(*a));
+  aggReady |= 1 << level;
+  aggFresh |= 1 << level;
+}
+
+// the intervals closed since the last call to aggResults, main loop only
+static void aggConvert(void)
+{
+  struct aggInterval a;
+  uint32_t end;
+  uint8_t i, fresh;
+
+  for (i = 0; i < AGG_LEVELS; i++) {
+    struct aggResults *r = &aggResults[i];
+    __disable_irq();
+    fresh = aggFresh & (1 << i);
+    aggFresh &= ~fresh;
+    a = closed[i];
+    end = closedEnd[i];
+    __enable_irq();
+    if (!fresh) {
+      continue;
+    }
+    r->end = end;
+    pfSumsToPower(&a.s, &r->power);
+    r->frequency = a.time ? ((uint64_t)a.cycles * 1000000000 / a.time) : 0;
+    r->Upp = a.Upp;
+    r->Ipp = a.Ipp;
+    r->windows = a.windows;
+    r->flagged = a.flagged;
+  }
+}
+
+// The 3s interval closes with the first window that completes 150 cycles
+// (180 above 55Hz). Windows are not split, so it is only exactly 3s when
+// the window length divides that: 7 cycle windows close it after 154
+// cycles, windows of 150 cycles or more make every window an interval.
+static bool agg3sComplete(const struct aggInterval *a)
+{
+  bool hz60 = (uint64_t)a->cycles * 1000000 > (uint64_t)a->time * 55;
+  return a->cycles >= (hz60 ? AGG_3S_CYCLES_60HZ : AGG_3S_CYCLES_50HZ);
+}
+
+// Called from the ADC interrupt for every completed window, time in us.
+// The window that straddles a 10 minute boundary still belongs to the
+// interval being closed, the 3s interval is resynchronised to it as well.
+// A flagged window (cut short by a pause) ends mid cycle, its sums count
+// but its cycles and time stay out of the frequency.
+void aggregateWindow(const struct pfSums *s, uint32_t time, uint16_t cycles, int32_t Upp, int32_t Ipp,
+                     bool flagged)
+{
+  struct aggInterval w;
+  uint32_t slot = millis() / AGG_SLOT_MS;
+
+  w.s = *s;
+  w.time = flagged ? 0 : time;
+  w.cycles = flagged ? 0 : cycles;
+  w.windows = 1;
+  w.flagged = flagged;
+  w.Upp = Upp;
+  w.Ipp = Ipp;
+
+  aggAdd(&interval[AGG_3S], &w);
+  aggAdd(&interval[AGG_10MIN], &w);
+
+  if (agg3sComplete(&interval[AGG_3S]) || (slot != aggSlot)) {
+    aggClose(AGG_3S);
+  }
+  if (slot != aggSlot) {
+    aggAdd(&interval[AGG_2H], &interval[AGG_10MIN]);
+    aggClose(AGG_10MIN);
+    if (!(slot % AGG_2H_SLOTS)) {
+      aggClose(AGG_2H);
+    }
+    aggSlot = slot;
+  }
+}
+
+// levels closed since the last call, one bit per level, with aggResults
+// brought up to date
+uint8_t aggregateReady(void)
+{
+  uint8_t r;
+
+  __disable_irq();
+  r = aggReady;
+  aggReady = 0;
+  __enable_irq();
+  aggConvert();
+  return r;
+}
+
+void aggregateReport(void)
+{
+  static const char *name[AGG_LEVELS] = { "3s", "10min", "2h" };
+  uint8_t i;
+
+  aggConvert();
+  printf("level windows flagged end_ms Urms_mV Irms_uA P_mW Q_mvar S_mVA PF_m f_mHz\n");
+  for (i = 0; i < AGG_LEVELS; i++) {
+    struct aggResults *r = &aggResults[i];
+    printf("%s %u %u %u %d %d %d %d %d %d %u\n", name[i], r->windows, r->flagged, r->end,
+           r->power.Urms, r->power.Irms, r->power.powerW, r->power.powerVAR,
+           r->power.powerVA, r->power.powerFactor, r->frequency);
+  }
+}
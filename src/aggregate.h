@@ -0,0 +1,29 @@
+#pragma once
+
+// IEC 61000-4-30 style aggregation of the measurement windows, whatever
+// their configured length. Levels are built from the raw window sums, RMS
+// values aggregate as the root of the mean square and nothing is kept per
+// window. aggResults is brought up to date by aggregateReady() and
+// aggregateReport(), from the main loop.
+enum {
+  AGG_3S = 0,     // 150/180 cycles or the first window past them
+  AGG_10MIN,      // windows ending in one 10 minute uptime slot
+  AGG_2H,         // 12 x 10 minutes
+  AGG_LEVELS
+};
+
+struct aggResults {
+  struct pfPower power;
+  uint32_t frequency;   // mHz
+  int32_t  Upp, Ipp;    // highest window value in the interval, mV and uA
+  uint32_t windows;
+  uint32_t flagged;     // windows cut short by a pause, see pfPause()
+  uint32_t end;         // millis() when the interval was closed
+};
+
+extern struct aggResults aggResults[AGG_LEVELS];
+
+void aggregateWindow(const struct pfSums *s, uint32_t time, uint16_t cycles, int32_t Upp, int32_t Ipp,
+                     bool flagged);
+uint8_t aggregateReady(void);
+void aggregateReport(void);
@@ -11,8 +11,12 @@
 #include <string.h>
 #include <stdio.h>
 
+#ifdef SIMULATOR
+#include "sim.h"                // host stand-ins, see support/sim
+#else
 #include "stm32f10x_conf.h"
 #include "core_cm3.h"
+#endif
 #include "printf.h"
 
 #ifndef M_PI
@@ -36,9 +40,23 @@
 #define digitalToggle(p, i) { p->ODR ^= i; }
 
 #include "drv_system.h"         // timers, delays, etc
+#include "drv_profile.h"
+#include "drv_flash.h"
 #include "drv_uart.h"
 #include "drv_led.h"
 #include "drv_lcd.h"
 #include "drv_adc.h"
 #include "drv_rotary.h"
+#include "fixmath.h"
 #include "powerfactor.h"
+#include "harmonics.h"
+#include "fft.h"
+#include "aggregate.h"
+#include "energy.h"
+#include "sliding.h"
+#include "events.h"
+#include "recorder.h"
+#include "inrush.h"
+#include "shape.h"
+#include "histogram.h"
+#include "flicker.h"
@@ -2,25 +2,227 @@
 
 /*
     2 channel ADC
+
+    ADC1/ADC2 run in regular simultaneous mode and DMA writes the packed
+    results (ADC1 in low halfword, ADC2 in high halfword) into a circular
+    ring of 2 * ADC_BLOCK_SIZE words. The handler is called from the HT/TC
+    interrupts with the half that was just completed, so interrupt overhead
+    is paid once per block instead of once per sample pair.
+
+    By default conversions are started by TIM3 TRGO so the sample rate is
+    exact and set by adcSetSampleRate(). Build with OPTIONS=ADC_FREERUN to
+    get the old continuous mode where the rate follows from ADCCLK and the
+    sample time.
+
+    Samples handed to the handler are 16 bit full scale, either 12 bit
+    conversions shifted up or the sum of 2^n oversampled conversions, see
+    adcSetDecimation().
 */
 
-void (*__adcHandler)(int16_t *) = NULL;
+void (*__adcHandler)(volatile uint32_t *, uint16_t) = NULL;
 
 #define ADC1_DR_Address    ((uint32_t)0x4001244C)
-__IO uint32_t ADC_DualConvertedValueTab[2];
+__IO uint32_t ADC_DualConvertedValueTab[2 * ADC_BLOCK_SIZE];
+
+#ifdef ADC_FREERUN
+#define ADC_TRIGGER       ADC_ExternalTrigConv_None
+#define ADC_CONTINUOUS    ENABLE
+#define ADC_SAMPLE_TIME   ADC_SampleTime_239Cycles5
+#else
+#define ADC_TRIGGER       ADC_ExternalTrigConv_T3_TRGO
+#define ADC_CONTINUOUS    DISABLE
+// 28.5 + 12.5 cycles at 18MHz ADCCLK = 2.3us, fast enough for 16x oversampling
+#define ADC_SAMPLE_TIME   ADC_SampleTime_28Cycles5
+// shortest conversion period in 72MHz timer ticks
+#define ADC_MIN_TICKS     (41 * 4)
+#endif
+
+static uint32_t __adcSampleRate = 0;
+static uint8_t  __adcDecimation = 0;  // log2 of the oversampling ratio
+
+#ifndef ADC_FREERUN
+static uint32_t __adcPrescaler = 1;
+static uint32_t __adcPeriod = 0;      // timer ticks per delivered sample, 24.8 fixed point
+static uint32_t __adcDither = 0;
+static uint32_t __adcNextTime = 0;    // ps per sample of the block being converted
+static uint32_t __adcBlockTime = 0;   // the same for the block being delivered
+
+static uint32_t __adcTimerClock(void)
+{
+  static uint32_t clock = 0;
+  if (!clock) {
+    RCC_ClocksTypeDef clocks;
+    RCC_GetClocksFreq(&clocks);
+    // timer clock runs at 2x PCLK1 when APB1 is divided
+    clock = clocks.PCLK1_Frequency;
+    if (clocks.PCLK1_Frequency != clocks.HCLK_Frequency) {
+      clock *= 2;
+    }
+  }
+  return clock;
+}
+
+static void __adcUpdateRate(void)
+{
+  __adcSampleRate = ((uint64_t)__adcTimerClock() << 8) / ((uint64_t)__adcPrescaler * __adcPeriod);
+}
+
+// Called once per block, spreads the fractional part of the conversion
+// period over consecutive blocks so the average rate has 1/256 tick resolution
+static void __adcRetune(uint8_t decimation)
+{
+  uint32_t conv = __adcPeriod >> decimation;
+  __adcDither += conv & 0xff;
+  TIM3->ARR = (conv >> 8) + (__adcDither >> 8) - 1;
+  __adcDither &= 0xff;
+  // the period the samples really get, dithered ticks and all
+  __adcNextTime = ((uint64_t)(TIM3->ARR + 1) << decimation) * __adcPrescaler * 1000000000000ULL / __adcTimerClock();
+}
+#endif
+
+// Set the delivered sample rate in Hz, returns the rate actually achieved
+// (0 in free running mode). With oversampling the ADC runs faster by the
+// decimation ratio.
+uint32_t adcSetSampleRate(uint32_t hz)
+{
+#ifndef ADC_FREERUN
+  uint32_t clock = __adcTimerClock();
+  uint32_t ticks, prescaler = 1;
+
+  if (!hz) {
+    return __adcSampleRate;
+  }
+  ticks = clock / hz;
+  while ((ticks / prescaler) > (65536 >> ADC_MAX_DECIMATION)) {
+    prescaler++;
+  }
+
+  __adcPrescaler = prescaler;
+  __adcPeriod = ((uint64_t)clock << 8) / ((uint64_t)hz * prescaler);
+  TIM_PrescalerConfig(TIM3, prescaler - 1, TIM_PSCReloadMode_Update);
+  __adcRetune(__adcDecimation);
+  __adcUpdateRate();
+#endif
+  return __adcSampleRate;
+}
+
+uint32_t adcGetSampleRate(void)
+{
+  return __adcSampleRate;
+}
+
+// Sample period in ps of the block currently handed to the handler, 0 in
+// free running mode. A retune only reaches the timer at the next block
+// interrupt, so this lags adcSetSamplePeriod() by one block; it is exact to
+// within the few samples converted during the interrupt latency.
+uint32_t adcGetSampleTime(void)
+{
+#ifndef ADC_FREERUN
+  return __adcBlockTime;
+#else
+  return 0;
+#endif
+}
+
+// Fine grained retuning for mains synchronous sampling, period is in
+// (prescaled) timer ticks per delivered sample, 24.8 fixed point
+void adcSetSamplePeriod(uint32_t period)
+{
+#ifndef ADC_FREERUN
+  uint32_t shortest = ((uint32_t)ADC_MIN_TICKS << (8 + __adcDecimation)) / __adcPrescaler;
+  __adcPeriod = constrain(period, shortest, (uint32_t)65536 << 8);
+  __adcUpdateRate();
+#endif
+}
+
+uint32_t adcGetSamplePeriod(void)
+{
+#ifndef ADC_FREERUN
+  return __adcPeriod;
+#else
+  return 0;
+#endif
+}
+
+// Oversample by 2^n and decimate back. Each doubling adds about half a bit
+// of noise limited resolution, 16x gives ~14 effective bits in the 16 bit
+// samples delivered to the handler.
+void adcSetDecimation(uint8_t n)
+{
+  n = min(n, ADC_MAX_DECIMATION);
+#ifndef ADC_FREERUN
+  while (n && (((__adcPeriod * __adcPrescaler) >> (n + 8)) < ADC_MIN_TICKS)) {
+    n--;
+  }
+#endif
+  __adcDecimation = n;
+}
+
+uint8_t adcGetDecimation(void)
+{
+  return __adcDecimation;
+}
+
+#ifndef ADC_FREERUN
+static void __adcTimerInit(void)
+{
+  TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure;
+
+  TIM_DeInit(TIM3);
+  TIM_TimeBaseStructInit(&TIM_TimeBaseStructure);
+  TIM_TimeBaseStructure.TIM_Period = 0xffff;
+  TIM_TimeBaseStructure.TIM_Prescaler = 0;
+  TIM_TimeBaseStructure.TIM_ClockDivision = TIM_CKD_DIV1;
+  TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+  TIM_TimeBaseInit(TIM3, &TIM_TimeBaseStructure);
+  TIM_ARRPreloadConfig(TIM3, ENABLE);
+  // update event -> TRGO -> ADC1 regular group (ADC2 follows in simultaneous mode)
+  TIM_SelectOutputTrigger(TIM3, TIM_TRGOSource_Update);
+  adcSetSampleRate(ADC_SAMPLE_RATE);
+  adcSetDecimation(ADC_DECIMATION);
+}
+#endif
+
+// Boxcar decimation in place. Both 12 bit results are summed in one word,
+// the halves can not carry into each other as 16 * 4095 < 65536. The sum is
+// scaled so the output is always 16 bit full scale.
+static uint16_t __adcDecimate(volatile uint32_t *block, uint16_t count, uint8_t decimation)
+{
+  volatile uint32_t *in = block, *out = block;
+  uint8_t shift = ADC_RESOLUTION_SHIFT - decimation;
+  uint16_t ratio = 1 << decimation;
+  uint16_t n, k;
+
+  count >>= decimation;
+  for (n = 0; n < count; n++) {
+    uint32_t sum = 0;
+    for (k = 0; k < ratio; k++) {
+      sum += *(in++);
+    }
+    *(out++) = sum << shift;
+  }
+  return count;
+}
 
 void __processADC(bool isFull)
 {
-  uint16_t _values[2];
-  _values[0] = ADC_DualConvertedValueTab[isFull?1:0] & 0xfff;
-  _values[1] = (ADC_DualConvertedValueTab[isFull?1:0]>>16) & 0xfff;
+  volatile uint32_t *block = &ADC_DualConvertedValueTab[isFull ? ADC_BLOCK_SIZE : 0];
+  uint8_t decimation = __adcDecimation;
+  uint16_t count;
+
+#ifndef ADC_FREERUN
+  __adcBlockTime = __adcNextTime;
+  __adcRetune(decimation);
+#endif
+  count = __adcDecimate(block, ADC_BLOCK_SIZE, decimation);
   if (__adcHandler) {
-    __adcHandler((int16_t*)_values);
+    __adcHandler(block, count);
   }
 }
 
 void DMA1_Channel1_IRQHandler(void)
 {
+  PROFILE_START(t);
   if (DMA_GetITStatus(DMA1_IT_HT1)) {
     DMA_ClearITPendingBit(DMA1_IT_HT1);
     __processADC(0);
@@ -29,9 +231,10 @@ void DMA1_Channel1_IRQHandler(void)
     DMA_ClearITPendingBit(DMA1_IT_TC1);
     __processADC(1);
   }
+  PROFILE_END(PROF_ADC_IRQ, t);
 }
 
-void adcInit(void (*h)(int16_t *))
+void adcInit(void (*h)(volatile uint32_t *, uint16_t))
 {
   GPIO_InitTypeDef GPIO_InitStructure;
   ADC_InitTypeDef ADC_InitStructure;
@@ -51,7 +254,7 @@ void adcInit(void (*h)(int16_t *))
   DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)ADC1_DR_Address;
   DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t)ADC_DualConvertedValueTab;
   DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
-  DMA_InitStructure.DMA_BufferSize = 2;
+  DMA_InitStructure.DMA_BufferSize = 2 * ADC_BLOCK_SIZE;
   DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
   DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
   DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
@@ -75,25 +278,25 @@ void adcInit(void (*h)(int16_t *))
   /* ADC1 configuration ------------------------------------------------------*/
   ADC_InitStructure.ADC_Mode = ADC_Mode_RegSimult;
   ADC_InitStructure.ADC_ScanConvMode = ENABLE;
-  ADC_InitStructure.ADC_ContinuousConvMode = ENABLE;
-  ADC_InitStructure.ADC_ExternalTrigConv = ADC_ExternalTrigConv_None;
+  ADC_InitStructure.ADC_ContinuousConvMode = ADC_CONTINUOUS;
+  ADC_InitStructure.ADC_ExternalTrigConv = ADC_TRIGGER;
   ADC_InitStructure.ADC_DataAlign = ADC_DataAlign_Right;
   ADC_InitStructure.ADC_NbrOfChannel = 1;
   ADC_Init(ADC1, &ADC_InitStructure);
   /* ADC1 regular channels configuration */
-  ADC_RegularChannelConfig(ADC1, ADC_Channel_0, 1, ADC_SampleTime_239Cycles5);
+  ADC_RegularChannelConfig(ADC1, ADC_Channel_0, 1, ADC_SAMPLE_TIME);
   /* Enable ADC1 DMA */
   ADC_DMACmd(ADC1, ENABLE);
   /* ADC2 configuration ------------------------------------------------------*/
   ADC_InitStructure.ADC_Mode = ADC_Mode_RegSimult;
   ADC_InitStructure.ADC_ScanConvMode = ENABLE;
-  ADC_InitStructure.ADC_ContinuousConvMode = ENABLE;
+  ADC_InitStructure.ADC_ContinuousConvMode = ADC_CONTINUOUS;
   ADC_InitStructure.ADC_ExternalTrigConv = ADC_ExternalTrigConv_None;
   ADC_InitStructure.ADC_DataAlign = ADC_DataAlign_Right;
   ADC_InitStructure.ADC_NbrOfChannel = 1;
   ADC_Init(ADC2, &ADC_InitStructure);
   /* ADC2 regular channels configuration */
-  ADC_RegularChannelConfig(ADC2, ADC_Channel_1, 1, ADC_SampleTime_239Cycles5);
+  ADC_RegularChannelConfig(ADC2, ADC_Channel_1, 1, ADC_SAMPLE_TIME);
   /* Enable ADC2 external trigger conversion */
   ADC_ExternalTrigConvCmd(ADC2, ENABLE);
 
@@ -125,6 +328,13 @@ void adcInit(void (*h)(int16_t *))
   /* Check the end of ADC2 calibration */
   while(ADC_GetCalibrationStatus(ADC2));
 
+#ifdef ADC_FREERUN
   /* Start ADC1 Software Conversion */
   ADC_SoftwareStartConvCmd(ADC1, ENABLE);
+#else
+  /* Enable ADC1 external trigger and start the trigger timer */
+  ADC_ExternalTrigConvCmd(ADC1, ENABLE);
+  __adcTimerInit();
+  TIM_Cmd(TIM3, ENABLE);
+#endif
 }
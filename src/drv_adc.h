@@ -1,5 +1,32 @@
 #include "board.h"
 
-extern __IO uint32_t ADC_DualConvertedValueTab[2];
+// sample pairs per DMA half buffer, handler is called once per block
+#ifndef ADC_BLOCK_SIZE
+#define ADC_BLOCK_SIZE 128
+#endif
 
-void adcInit(void (*)(int16_t *));
+// default trigger rate, 256 samples per 50Hz cycle
+#ifndef ADC_SAMPLE_RATE
+#define ADC_SAMPLE_RATE 12800
+#endif
+
+// delivered samples are 16 bit full scale, 12 bit ADC results shifted up
+// or 2^4 oversampled (~14 effective bits)
+#define ADC_RESOLUTION_SHIFT 4
+#define ADC_MAX_DECIMATION   ADC_RESOLUTION_SHIFT
+
+// default oversampling in timer mode, 2^4 = 16 conversions per sample
+#ifndef ADC_DECIMATION
+#define ADC_DECIMATION 4
+#endif
+
+extern __IO uint32_t ADC_DualConvertedValueTab[2 * ADC_BLOCK_SIZE];
+
+void adcInit(void (*)(volatile uint32_t *, uint16_t));
+uint32_t adcSetSampleRate(uint32_t hz);
+uint32_t adcGetSampleRate(void);
+uint32_t adcGetSampleTime(void);
+void adcSetSamplePeriod(uint32_t period);
+uint32_t adcGetSamplePeriod(void);
+void adcSetDecimation(uint8_t n);
+uint8_t adcGetDecimation(void);
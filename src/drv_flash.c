@@ -0,0 +1,200 @@
+#include "board.h"
+
+/*
+    Versioned records in a reserved flash page
+
+    A record is a small header followed by the data, padded to whole words.
+    The CRC is computed by the CRC unit over the padded data. A record is
+    only accepted when version, size and CRC all match, so a changed
+    struct layout just needs a new version number.
+
+    Erasing a page stalls the CPU for ~20ms, ADC blocks arriving meanwhile
+    are late. Callers pause the measurement around a save, see pfPause().
+*/
+
+struct flashHeader {
+  uint16_t version;
+  uint16_t size;
+  uint32_t crc;
+};
+
+#define FLASH_WORDS(size) (((size) + 3) / 4)
+
+uint32_t flashCRC(const void *data, uint16_t size)
+{
+  const uint8_t *p = data;
+  uint16_t i;
+
+  CRC_ResetDR();
+  for (i = 0; i < FLASH_WORDS(size); i++) {
+    uint32_t w = 0;
+    memcpy(&w, p + i * 4, min(4, size - i * 4));
+    CRC_CalcCRC(w);
+  }
+  return CRC_GetCRC();
+}
+
+bool flashLoad(uint32_t page, void *data, uint16_t size, uint16_t version)
+{
+  const struct flashHeader *h = (const struct flashHeader *)page;
+  const void *stored = (const void *)(page + sizeof(struct flashHeader));
+
+  if ((h->version != version) || (h->size != size) ||
+      (sizeof(struct flashHeader) + size > FLASH_PAGE_SIZE)) {
+    return false;
+  }
+  if (h->crc != flashCRC(stored, size)) {
+    return false;
+  }
+  memcpy(data, stored, size);
+  return true;
+}
+
+bool flashSave(uint32_t page, const void *data, uint16_t size, uint16_t version)
+{
+  struct flashHeader h;
+  const uint8_t *p = data;
+  uint32_t addr = page + sizeof(h);
+  FLASH_Status status;
+  uint16_t i;
+
+  if (sizeof(h) + size > FLASH_PAGE_SIZE) {
+    return false;
+  }
+  h.version = version;
+  h.size = size;
+  h.crc = flashCRC(data, size);
+
+  FLASH_Unlock();
+  FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_PGERR | FLASH_FLAG_WRPRTERR);
+  status = FLASH_ErasePage(page);
+  // data first, header last so an interrupted save never looks valid
+  for (i = 0; (status == FLASH_COMPLETE) && (i < FLASH_WORDS(size)); i++) {
+    uint32_t w = 0xffffffff;
+    memcpy(&w, p + i * 4, min(4, size - i * 4));
+    status = FLASH_ProgramWord(addr + i * 4, w);
+  }
+  if (status == FLASH_COMPLETE) {
+    status = FLASH_ProgramWord(page + 4, h.crc);
+  }
+  if (status == FLASH_COMPLETE) {
+    status = FLASH_ProgramWord(page, h.version | ((uint32_t)h.size << 16));
+  }
+  FLASH_Lock();
+
+  return (status == FLASH_COMPLETE);
+}
+
+/*
+    Record log for data saved often
+
+    Records go one after the other into a ring of pages, each with a
+    sequence number, and the newest valid one is loaded. A page is erased
+    only when the log moves on to it, so the wear is spread over all pages
+    and most saves just program a few words.
+*/
+
+struct flashLogHeader {
+  uint16_t version;
+  uint16_t size;
+  uint32_t crc;     // data, then seq
+  uint32_t seq;
+};
+
+#define FLASH_LOG_SLOT(size) (sizeof(struct flashLogHeader) + FLASH_WORDS(size) * 4)
+
+static uint32_t flashLogCRC(const void *data, uint16_t size, uint32_t seq)
+{
+  flashCRC(data, size);
+  return CRC_CalcCRC(seq);
+}
+
+// newest valid record, NULL if there is none
+static const struct flashLogHeader *flashLogFind(uint32_t first, uint8_t pages, uint16_t size, uint16_t version)
+{
+  const struct flashLogHeader *best = NULL;
+  uint16_t slot = FLASH_LOG_SLOT(size);
+  uint16_t p, i;
+
+  for (p = 0; p < pages; p++) {
+    for (i = 0; (i + 1) * slot <= FLASH_PAGE_SIZE; i++) {
+      const struct flashLogHeader *h = (const struct flashLogHeader *)(first + p * FLASH_PAGE_SIZE + i * slot);
+      if ((h->version != version) || (h->size != size) ||
+          (h->crc != flashLogCRC(h + 1, size, h->seq))) {
+        continue;
+      }
+      if (!best || ((int32_t)(h->seq - best->seq) > 0)) {
+        best = h;
+      }
+    }
+  }
+  return best;
+}
+
+bool flashLogLoad(uint32_t first, uint8_t pages, void *data, uint16_t size, uint16_t version)
+{
+  const struct flashLogHeader *h = flashLogFind(first, pages, size, version);
+
+  if (!h) {
+    return false;
+  }
+  memcpy(data, h + 1, size);
+  return true;
+}
+
+bool flashLogSave(uint32_t first, uint8_t pages, const void *data, uint16_t size, uint16_t version)
+{
+  const struct flashLogHeader *last = flashLogFind(first, pages, size, version);
+  uint16_t slot = FLASH_LOG_SLOT(size);
+  const uint8_t *p = data;
+  uint32_t addr, seq = 0;
+  bool erase = true;
+  FLASH_Status status = FLASH_COMPLETE;
+  uint16_t i;
+
+  if (slot > FLASH_PAGE_SIZE) {
+    return false;
+  }
+  addr = first;
+  if (last) {
+    uint32_t page = ((uint32_t)last - first) / FLASH_PAGE_SIZE;
+    seq = last->seq + 1;
+    addr = (uint32_t)last + slot;
+    erase = false;
+    // the slot after the newest record has to be in the same page and
+    // blank, otherwise move on to the next page
+    if (addr + slot > first + (page + 1) * FLASH_PAGE_SIZE) {
+      erase = true;
+    }
+    for (i = 0; !erase && (i < slot / 4); i++) {
+      erase = (*(const uint32_t *)(addr + i * 4) != 0xffffffff);
+    }
+    if (erase) {
+      addr = first + ((page + 1) % pages) * FLASH_PAGE_SIZE;
+    }
+  }
+
+  FLASH_Unlock();
+  FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_PGERR | FLASH_FLAG_WRPRTERR);
+  if (erase) {
+    status = FLASH_ErasePage(addr);
+  }
+  // data first, header last so an interrupted save never looks valid
+  for (i = 0; (status == FLASH_COMPLETE) && (i < FLASH_WORDS(size)); i++) {
+    uint32_t w = 0xffffffff;
+    memcpy(&w, p + i * 4, min(4, size - i * 4));
+    status = FLASH_ProgramWord(addr + sizeof(struct flashLogHeader) + i * 4, w);
+  }
+  if (status == FLASH_COMPLETE) {
+    status = FLASH_ProgramWord(addr + 8, seq);
+  }
+  if (status == FLASH_COMPLETE) {
+    status = FLASH_ProgramWord(addr + 4, flashLogCRC(data, size, seq));
+  }
+  if (status == FLASH_COMPLETE) {
+    status = FLASH_ProgramWord(addr, version | ((uint32_t)size << 16));
+  }
+  FLASH_Lock();
+
+  return (status == FLASH_COMPLETE);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+// 1KB pages on medium density parts. The linker script stops FLASH at
+// 123K, the last page holds the calibration record and the four before it
+// the energy register log.
+#define FLASH_PAGE_SIZE    1024
+#define FLASH_CONFIG_PAGE  0x0801FC00
+#define FLASH_ENERGY_PAGE  0x0801EC00
+#define FLASH_ENERGY_PAGES 4
+
+bool flashLoad(uint32_t page, void *data, uint16_t size, uint16_t version);
+bool flashSave(uint32_t page, const void *data, uint16_t size, uint16_t version);
+uint32_t flashCRC(const void *data, uint16_t size);
+bool flashLogLoad(uint32_t first, uint8_t pages, void *data, uint16_t size, uint16_t version);
+bool flashLogSave(uint32_t first, uint8_t pages, const void *data, uint16_t size, uint16_t version);
@@ -0,0 +1,101 @@
+#include "board.h"
+
+#ifdef PROFILE
+
+/*
+    Min/avg/max cycle counts per instrumented section. CPU load is the
+    share of all cycles since the last reset not spent idle in the main
+    loop's delay(), irq load the share spent in the two DMA interrupts.
+*/
+
+struct profileSlot {
+  uint32_t min, max, count;
+  uint64_t total;
+};
+
+static struct profileSlot __profile[PROF_COUNT];
+static uint32_t __profileStart;
+
+static const char *__profileName[PROF_COUNT] = {
+  "adc irq", "sample", "integrate", "harmonics", "results", "lcd", "fft", "uart irq", "flicker",
+  "idle"
+};
+
+void profileInit(void)
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT_CYCCNT = 0;
+  DWT_CTRL |= 1; // CYCCNTENA
+  profileReset();
+}
+
+void profileAdd(uint8_t slot, uint32_t cycles)
+{
+  struct profileSlot *p = &__profile[slot];
+  if (cycles < p->min) {
+    p->min = cycles;
+  }
+  if (cycles > p->max) {
+    p->max = cycles;
+  }
+  p->total += cycles;
+  p->count++;
+}
+
+// cycles spent in the interrupts so far
+uint64_t profileIrqCycles(void)
+{
+  uint64_t cycles;
+
+  __disable_irq();
+  cycles = __profile[PROF_ADC_IRQ].total + __profile[PROF_UART_IRQ].total;
+  __enable_irq();
+  return cycles;
+}
+
+void profileReset(void)
+{
+  uint8_t i;
+  __disable_irq();
+  for (i = 0; i < PROF_COUNT; i++) {
+    __profile[i].min = 0xffffffff;
+    __profile[i].max = 0;
+    __profile[i].count = 0;
+    __profile[i].total = 0;
+  }
+  __profileStart = millis();
+  __enable_irq();
+}
+
+void profileReport(void)
+{
+  struct profileSlot p[PROF_COUNT];
+  uint32_t elapsed;
+  uint64_t busy, irq;
+  uint8_t i;
+
+  // snapshot so the numbers are consistent with each other
+  __disable_irq();
+  memcpy(p, __profile, sizeof(p));
+  elapsed = millis() - __profileStart;
+  __enable_irq();
+
+  printf("  section   count      min      avg      max (cycles)\n");
+  for (i = 0; i < PROF_COUNT; i++) {
+    printf("%9s %7u %8u %8u %8u\n", __profileName[i], p[i].count,
+           p[i].count ? p[i].min : 0,
+           p[i].count ? (uint32_t)(p[i].total / p[i].count) : 0,
+           p[i].max);
+  }
+  if (elapsed) {
+    // 72000 cycles per ms
+    irq = p[PROF_ADC_IRQ].total + p[PROF_UART_IRQ].total;
+    busy = (uint64_t)elapsed * 72000;
+    busy -= min(p[PROF_IDLE].total, busy);
+    printf("cpu load %u.%u%%, irq load %u.%u%% over %u ms\n",
+           (uint32_t)(busy / (720 * elapsed)), (uint32_t)(busy / (72 * elapsed) % 10),
+           (uint32_t)(irq / (720 * elapsed)), (uint32_t)(irq / (72 * elapsed) % 10), elapsed);
+  }
+}
+
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+/*
+    Cycle counting of hot paths with the DWT cycle counter.
+    Build with OPTIONS=PROFILE, otherwise the macros compile away.
+*/
+
+enum {
+  PROF_ADC_IRQ = 0,   // DMA1_Channel1_IRQHandler
+  PROF_ADC_SAMPLE,    // handleValuesFromADC()
+  PROF_INTEGRATE,     // integrateMeasurement()
+  PROF_HARMONICS,     // hrmSample()
+  PROF_RESULTS,       // pfWaitMeasure()
+  PROF_LCD,           // LCD refresh in main()
+  PROF_FFT,           // fftTransform()
+  PROF_UART_IRQ,      // DMA1_Channel4_IRQHandler
+  PROF_FLICKER,       // flicker chain, once per FLK_DECIMATION samples
+  PROF_IDLE,          // delay() in main(), less the interrupts taken meanwhile
+  PROF_COUNT
+};
+
+#ifdef PROFILE
+
+#define DWT_CTRL   (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+
+#define PROFILE_START(v)    uint32_t v = DWT_CYCCNT
+#define PROFILE_END(slot,v) profileAdd(slot, DWT_CYCCNT - (v))
+
+// idle time, the interrupt cycles taken in between are not idle
+#define PROFILE_IDLE_START(v) uint32_t v = DWT_CYCCNT; uint64_t v##irq = profileIrqCycles()
+#define PROFILE_IDLE_END(v)   profileAdd(PROF_IDLE, DWT_CYCCNT - (v) - (uint32_t)(profileIrqCycles() - v##irq))
+
+void profileInit(void);
+void profileAdd(uint8_t slot, uint32_t cycles);
+uint64_t profileIrqCycles(void);
+void profileReset(void);
+void profileReport(void);
+
+#else
+
+#define PROFILE_START(v)
+#define PROFILE_END(slot,v)
+#define PROFILE_IDLE_START(v)
+#define PROFILE_IDLE_END(v)
+
+#define profileInit()
+#define profileReset()
+#define profileReport() printf("profiling not built in, use OPTIONS=PROFILE\n")
+
+#endif
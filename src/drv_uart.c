@@ -29,12 +29,14 @@ static void uartTxDMA(void)
 
 void DMA1_Channel4_IRQHandler(void)
 {
+  PROFILE_START(t);
   DMA_ClearITPendingBit(DMA1_IT_TC4);
   DMA_Cmd(DMA1_Channel4, DISABLE);
 
   if (txBufferHead != txBufferTail) {
     uartTxDMA();
   }
+  PROFILE_END(PROF_UART_IRQ, t);
 }
 
 void uartInit(uint32_t speed)
@@ -0,0 +1,113 @@
+#include "board.h"
+
+/*
+    Each completed window adds its mean power times its length, in pJ
+    (uW x us), to pending sums. This runs from the ADC interrupt so windows
+    the main loop never reads still count. energyUpdate() moves the pending
+    energy into the registers and carries whole milli units, the remainder
+    stays exact however long it runs.
+
+    Import and export are split per mains cycle: each cycle's net U I goes
+    to one side by its sign, and the reactive energy likewise per harmonic
+    block (one cycle when locked). A load that draws and feeds back within
+    a window counts both ways, power flow that reverses within a single
+    cycle is netted out over that cycle, as it is in the reactive energy
+    of any meter.
+
+    The registers are saved every ENERGY_SAVE_MS to a log over
+    FLASH_ENERGY_PAGES pages. A record takes 76 bytes, 13 fit a 1K page, so
+    each page is erased once every 52 saves: every 13 hours with 15 minute
+    saves, ~14 years at 10k erase cycles. The measurement is paused around
+    the write, see pfPause().
+*/
+
+#define PJ_PER_MILLI 3600000000000ULL   // 1 mWh = 3.6 J
+
+struct energyRegister energy[ENERGY_REGISTERS];
+
+static uint64_t energyPending[ENERGY_REGISTERS];  // pJ, drained by energyUpdate()
+static uint32_t energyLastSave;
+
+// mean in nW Q8 of a sum over n samples, in sample units squared
+static int64_t energyPower(int64_t sum, uint32_t n)
+{
+  return pfPowerScale(fixMean(sum, n, 8));
+}
+
+// power of either sign, in nW Q8
+static void energyAdd(uint8_t r, int64_t power, uint32_t time)
+{
+  // nW Q8 to uW, times us
+  energyPending[r] += ((power < 0) ? -power : power) / 256000 * time;
+}
+
+// called from the ADC interrupt for every completed window, with the U I
+// of its positive and negative cycles; time in us
+void energyWindow(const struct pfSums *s, const int64_t cycleUI[2], const struct hrmSums *h, uint32_t time)
+{
+  uint32_t n;
+
+  if (!s->samples) {
+    return;
+  }
+  // the cycles are spread over the window's length
+  energyAdd(ENERGY_IMPORT, energyPower(cycleUI[0], s->samples), time);
+  energyAdd(ENERGY_EXPORT, energyPower(cycleUI[1], s->samples), time);
+
+  // a block's U I* is Au Ai (PLL_SAMPLES / 2)^2 e^j(phi), so the mean Q
+  // in sample units squared is 2 Im / PLL_SAMPLES^2 per block
+  if (h->blocks) {
+    n = (uint32_t)h->blocks * PLL_SAMPLES * PLL_SAMPLES;
+    energyAdd(ENERGY_Q_LAG, energyPower((h->q1 - h->q1lead) * 2, n), time);
+    energyAdd(ENERGY_Q_LEAD, energyPower(h->q1lead * 2, n), time);
+  }
+}
+
+// fold the pending energy into the registers and save them when due
+void energyUpdate(void)
+{
+  uint64_t pending[ENERGY_REGISTERS];
+  uint8_t r;
+
+  __disable_irq();
+  memcpy(pending, energyPending, sizeof(pending));
+  memset(energyPending, 0, sizeof(energyPending));
+  __enable_irq();
+
+  for (r = 0; r < ENERGY_REGISTERS; r++) {
+    struct energyRegister *e = &energy[r];
+    e->pico += pending[r];
+    e->milli += e->pico / PJ_PER_MILLI;
+    e->pico %= PJ_PER_MILLI;
+  }
+
+  if ((millis() - energyLastSave) >= ENERGY_SAVE_MS) {
+    energySave();
+  }
+}
+
+bool energyLoad(void)
+{
+  return flashLogLoad(FLASH_ENERGY_PAGE, FLASH_ENERGY_PAGES, energy, sizeof(energy), ENERGY_VERSION);
+}
+
+bool energySave(void)
+{
+  bool ok;
+
+  energyLastSave = millis();
+  pfPause();
+  ok = flashLogSave(FLASH_ENERGY_PAGE, FLASH_ENERGY_PAGES, energy, sizeof(energy), ENERGY_VERSION);
+  pfResume();
+  return ok;
+}
+
+void energyReport(void)
+{
+  static const char *name[ENERGY_REGISTERS] = { "import Wh", "export Wh", "lag varh", "lead varh" };
+  uint8_t r;
+
+  for (r = 0; r < ENERGY_REGISTERS; r++) {
+    printf("%s %u.%03u\n", name[r], (uint32_t)(energy[r].milli / 1000), (uint32_t)(energy[r].milli % 1000));
+  }
+}
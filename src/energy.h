@@ -0,0 +1,30 @@
+#pragma once
+
+// Energy registers, integrated from every window the engine measures.
+// Active energy is split by the sign of the net power of each cycle,
+// reactive energy (fundamental, from the harmonic bank) by the sign of Q
+// of each block.
+enum {
+  ENERGY_IMPORT = 0,    // P > 0, Wh
+  ENERGY_EXPORT,        // P < 0, Wh
+  ENERGY_Q_LAG,         // Q > 0 (inductive), varh
+  ENERGY_Q_LEAD,        // Q < 0 (capacitive), varh
+  ENERGY_REGISTERS
+};
+
+// whole milli units plus the exact remainder, never rounded
+struct energyRegister {
+  uint64_t milli;       // mWh or mvarh
+  uint64_t pico;        // pJ (pvar s) below one milli unit
+};
+
+#define ENERGY_VERSION 1
+#define ENERGY_SAVE_MS (15 * 60 * 1000UL)
+
+extern struct energyRegister energy[ENERGY_REGISTERS];
+
+void energyWindow(const struct pfSums *s, const int64_t cycleUI[2], const struct hrmSums *h, uint32_t time);
+void energyUpdate(void);
+bool energyLoad(void);
+bool energySave(void);
+void energyReport(void);
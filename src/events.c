@@ -0,0 +1,127 @@
+#include "board.h"
+
+/*
+    evtHalfCycle() runs from the ADC interrupt once per half cycle. The
+    running event is kept aside and only goes into the log when it ends,
+    the log is a ring that keeps the last EVT_LOG_SIZE events.
+*/
+
+struct evtConfig evtConfig = { 230000, 90, 110, 5, 2 };
+int32_t evtHalfRms;
+
+// thresholds in mV, derived from evtConfig
+static int32_t evtSagStart, evtSagEnd;
+static int32_t evtSwellStart, evtSwellEnd;
+static int32_t evtInterruption;
+
+static struct evtRecord evtLog[EVT_LOG_SIZE];
+static uint16_t evtCount;                 // events logged since reset
+static struct evtRecord evtActive;        // type EVT_NONE outside events
+
+static int32_t evtPercent(uint8_t percent)
+{
+  return (uint64_t)evtConfig.declared * percent / 100;
+}
+
+static void evtThresholds(void)
+{
+  evtSagStart = evtPercent(evtConfig.sag);
+  evtSagEnd = evtPercent(evtConfig.sag + evtConfig.hysteresis);
+  evtSwellStart = evtPercent(evtConfig.swell);
+  evtSwellEnd = evtPercent(max(evtConfig.swell - evtConfig.hysteresis, 100));
+  evtInterruption = evtPercent(evtConfig.interruption);
+}
+
+void evtSetConfig(const struct evtConfig *c)
+{
+  __disable_irq();
+  evtConfig = *c;
+  evtConfig.sag = min(c->sag, 100);
+  evtConfig.interruption = min(c->interruption, evtConfig.sag);
+  evtConfig.swell = max(c->swell, 100);
+  evtThresholds();
+  // whatever was running was measured against the old thresholds
+  evtActive.type = EVT_NONE;
+  __enable_irq();
+}
+
+static void evtStart(uint8_t type, int32_t urms)
+{
+  evtActive.type = type;
+  evtActive.start = millis();
+  evtActive.extreme = urms;
+  recTrigger(REC_TRIG_EVENT);
+}
+
+static void evtEnd(void)
+{
+  evtActive.duration = millis() - evtActive.start;
+  evtLog[evtCount % EVT_LOG_SIZE] = evtActive;
+  evtCount++;
+  evtActive.type = EVT_NONE;
+}
+
+// called from the ADC interrupt with every new Urms(1/2) in mV
+void evtHalfCycle(int32_t urms)
+{
+  evtHalfRms = urms;
+  if (!evtConfig.declared) {
+    return;     // detection off
+  }
+  if (!evtSwellStart) {
+    // the defaults, nothing was set yet
+    evtThresholds();
+  }
+
+  switch (evtActive.type) {
+  case EVT_NONE:
+    if (urms > evtSwellStart) {
+      evtStart(EVT_SWELL, urms);
+    } else if (urms < evtSagStart) {
+      evtStart((urms < evtInterruption) ? EVT_INTERRUPTION : EVT_SAG, urms);
+    }
+    break;
+  case EVT_SWELL:
+    evtActive.extreme = max(evtActive.extreme, urms);
+    if (urms < evtSwellEnd) {
+      evtEnd();
+    }
+    break;
+  default:
+    evtActive.extreme = min(evtActive.extreme, urms);
+    if (urms < evtInterruption) {
+      evtActive.type = EVT_INTERRUPTION;
+    }
+    if (urms > evtSagEnd) {
+      evtEnd();
+    }
+    break;
+  }
+}
+
+void evtReport(void)
+{
+  static const char *name[EVT_TYPES] = { "-", "sag", "swell", "interruption" };
+  struct evtRecord log[EVT_LOG_SIZE], active;
+  uint16_t count, n, first;
+
+  __disable_irq();
+  memcpy(log, evtLog, sizeof(log));
+  active = evtActive;
+  count = evtCount;
+  __enable_irq();
+
+  printf("events declared %d mV sag %d%% swell %d%% interruption %d%% hysteresis %d%%\n",
+         evtConfig.declared, evtConfig.sag, evtConfig.swell, evtConfig.interruption,
+         evtConfig.hysteresis);
+  printf("%d logged, Urms(1/2) %d mV\n", count, evtHalfRms);
+  printf("n type start_ms duration_ms extreme_mV\n");
+  first = (count > EVT_LOG_SIZE) ? (count - EVT_LOG_SIZE) : 0;
+  for (n = first; n < count; n++) {
+    struct evtRecord *e = &log[n % EVT_LOG_SIZE];
+    printf("%d %s %u %u %d\n", n, name[e->type], e->start, e->duration, e->extreme);
+  }
+  if (active.type != EVT_NONE) {
+    printf("%d %s %u running %d\n", count, name[active.type], active.start, active.extreme);
+  }
+}
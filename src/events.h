@@ -0,0 +1,36 @@
+#pragma once
+
+// Voltage sags (dips), swells and interruptions from Urms(1/2), the RMS
+// over one cycle refreshed every half cycle (IEC 61000-4-30). Thresholds
+// are in percent of the declared voltage, an event ends once the voltage
+// is back past its threshold by the hysteresis.
+enum {
+  EVT_NONE = 0,
+  EVT_SAG,
+  EVT_SWELL,
+  EVT_INTERRUPTION,     // a sag that went below the interruption threshold
+  EVT_TYPES
+};
+
+#define EVT_LOG_SIZE 16
+
+struct evtConfig {
+  uint32_t declared;      // mV, 0 turns detection off
+  uint8_t  sag, swell;    // % of declared
+  uint8_t  interruption;  // % of declared
+  uint8_t  hysteresis;    // % of declared
+};
+
+struct evtRecord {
+  uint32_t start;         // millis()
+  uint32_t duration;      // ms
+  int32_t  extreme;       // mV, lowest Urms(1/2) of a sag, highest of a swell
+  uint8_t  type;
+};
+
+extern struct evtConfig evtConfig;
+extern int32_t evtHalfRms;    // mV, the latest Urms(1/2)
+
+void evtSetConfig(const struct evtConfig *c);
+void evtHalfCycle(int32_t urms);
+void evtReport(void);
@@ -0,0 +1,243 @@
+#include "board.h"
+
+/*
+    In place fixed point FFT of a real block, as a complex FFT of half the
+    length followed by a split pass (FFT_POINTS complex points carry
+    FFT_SAMPLES real samples).
+
+    Data is 32 bit with Q31 twiddles, every butterfly is four 32x32->64
+    multiplies (SMULL) whose upper words are the product halved, so each
+    radix-2 stage scales by 1/2 and nothing can overflow. Samples enter
+    with FFT_INPUT_SHIFT bits of headroom for the split pass; a sine on a
+    bin comes out as amplitude << FFT_INPUT_SHIFT, as do DC and Nyquist.
+
+    The bit reversal table lives in flash, the twiddles and the window come
+    from the quarter wave sine table of fixSin().
+
+    Cost of one 1024 point transform, Hann window included:
+      host    'pfsim -F', gcc -O2 on a 2.1 GHz Xeon: 15.3 us, ~32000 cycles
+      target  "fft" line of 'P' after 'F', built with OPTIONS=PROFILE:
+              not measured yet. Going by the instruction count, the
+              2304 butterflies of 4 SMULL, 4 loads and 4 stores each and
+              the split pass come to ~130000 cycles, ~1.8 ms at 72 MHz
+*/
+
+#define FFT_INPUT_SHIFT 14
+
+#if FFT_SAMPLES != FIX_SINE_STEPS
+#error "the twiddles and the window come from fixSin(), FFT_SAMPLES must match"
+#endif
+
+// 8 bit reversal, larger indices are reversed bytewise
+#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
+#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
+static const uint8_t fftReverse8[256] = {
+  R6(0), R6(2), R6(1), R6(3)
+};
+
+enum {
+  FFT_IDLE = 0,
+  FFT_ARMED,        // waiting for a positive zero crossing
+  FFT_CAPTURE,
+  FFT_DONE,         // block captured, waiting for fftTransform()
+  FFT_LENT,         // fftData is in use elsewhere, see fftClaim()
+};
+
+struct fftComplex fftData[FFT_POINTS];
+
+static volatile uint8_t fftState;
+static uint8_t  fftChannel;
+static uint16_t fftPos;
+static bool     fftLocked;      // sampling loop locked for the whole block
+static uint8_t  fftWindow;      // window of the last transform
+
+static inline uint16_t fftBitReverse(uint16_t i)
+{
+  return ((fftReverse8[i & 0xff] << 8) | fftReverse8[i >> 8]) >> (16 - FFT_BITS);
+}
+
+// capture FFT_SAMPLES samples of U (0) or I (1) from the next crossing on
+void fftRequest(uint8_t ch)
+{
+  if (fftState == FFT_LENT) {
+    printf("fft buffer in use\n");
+    return;
+  }
+  __disable_irq();
+  fftChannel = ch;
+  fftPos = 0;
+  fftState = FFT_ARMED;
+  __enable_irq();
+}
+
+// called for every sample from the ADC interrupt
+void fftSample(int16_t u, int16_t i, bool crossed)
+{
+  int32_t x;
+
+  if ((fftState == FFT_ARMED) && crossed) {
+    fftLocked = pllLocked;
+    fftState = FFT_CAPTURE;
+  }
+  if (fftState != FFT_CAPTURE) {
+    return;
+  }
+  x = (int32_t)(fftChannel ? i : u) * (1 << FFT_INPUT_SHIFT);
+  if (fftPos & 1) {
+    fftData[fftPos >> 1].im = x;
+  } else {
+    fftData[fftPos >> 1].re = x;
+  }
+  if (++fftPos == FFT_SAMPLES) {
+    fftLocked = fftLocked && pllLocked;
+    fftState = FFT_DONE;
+  }
+}
+
+bool fftReady(void)
+{
+  return fftState == FFT_DONE;
+}
+
+// Lends fftData (FFT_POINTS * 8 bytes) out between transforms so RAM is
+// not spent twice, fftRequest() is refused until fftRelease().
+bool fftClaim(void)
+{
+  bool idle;
+
+  __disable_irq();
+  idle = (fftState == FFT_IDLE);
+  if (idle) {
+    fftState = FFT_LENT;
+  }
+  __enable_irq();
+  return idle;
+}
+
+void fftRelease(void)
+{
+  if (fftState == FFT_LENT) {
+    fftState = FFT_IDLE;
+  }
+}
+
+static void fftHann(void)
+{
+  uint16_t n;
+  for (n = 0; n < FFT_POINTS; n++) {
+    // (1 - cos) / 2, Q31
+    int32_t w0 = 0x40000000 - (fixCos(2 * n) >> 1);
+    int32_t w1 = 0x40000000 - (fixCos(2 * n + 1) >> 1);
+    fftData[n].re = ((int64_t)fftData[n].re * w0) >> 31;
+    fftData[n].im = ((int64_t)fftData[n].im * w1) >> 31;
+  }
+}
+
+static void fftComplexTransform(void)
+{
+  uint16_t i, j, len;
+
+  for (i = 0; i < FFT_POINTS; i++) {
+    j = fftBitReverse(i);
+    if (j > i) {
+      struct fftComplex t = fftData[i];
+      fftData[i] = fftData[j];
+      fftData[j] = t;
+    }
+  }
+
+  for (len = 2; len <= FFT_POINTS; len <<= 1) {
+    uint16_t half = len >> 1;
+    uint16_t step = FFT_SAMPLES / len;
+    for (j = 0; j < half; j++) {
+      int32_t wr = fixCos(j * step);
+      int32_t wi = -fixSin(j * step);
+      for (i = j; i < FFT_POINTS; i += len) {
+        struct fftComplex *a = &fftData[i], *b = &fftData[i + half];
+        // w * b / 2 and a / 2
+        int32_t tr = ((int64_t)wr * b->re - (int64_t)wi * b->im) >> 32;
+        int32_t ti = ((int64_t)wr * b->im + (int64_t)wi * b->re) >> 32;
+        int32_t ar = a->re >> 1, ai = a->im >> 1;
+        b->re = ar - tr;
+        b->im = ai - ti;
+        a->re = ar + tr;
+        a->im = ai + ti;
+      }
+    }
+  }
+}
+
+// Z is the complex transform of the packed pairs, for k and N - k:
+// E = (Z[k] + Z*[N-k]) / 2, O = (Z[k] - Z*[N-k]) / 2j,
+// X[k] = E + W^k O and X[N-k] = (E - W^k O)*
+static void fftSplit(void)
+{
+  uint16_t k;
+  int32_t dc = fftData[0].re >> 1, odd = fftData[0].im >> 1;
+
+  fftData[0].re = dc + odd;
+  fftData[0].im = dc - odd;   // Nyquist
+
+  for (k = 1; k <= FFT_POINTS / 2; k++) {
+    struct fftComplex *a = &fftData[k], *b = &fftData[FFT_POINTS - k];
+    int32_t er = (a->re >> 1) + (b->re >> 1);
+    int32_t ei = (a->im >> 1) - (b->im >> 1);
+    int32_t dr = (a->im >> 1) + (b->im >> 1);
+    int32_t di = (b->re >> 1) - (a->re >> 1);
+    int32_t wr = fixCos(k);
+    int32_t wi = -fixSin(k);
+    int32_t tr = ((int64_t)wr * dr - (int64_t)wi * di) >> 31;
+    int32_t ti = ((int64_t)wr * di + (int64_t)wi * dr) >> 31;
+    a->re = er + tr;
+    a->im = ei + ti;
+    b->re = er - tr;
+    b->im = ti - ei;
+  }
+}
+
+// transform the captured block, fftAmplitude() is valid afterwards
+void fftTransform(uint8_t window)
+{
+  if (window == FFT_AUTO) {
+    window = fftLocked ? FFT_RECT : FFT_HANN;
+  }
+  fftWindow = window;
+  if (window == FFT_HANN) {
+    fftHann();
+  }
+  fftComplexTransform();
+  fftSplit();
+  fftState = FFT_IDLE;
+}
+
+// peak amplitude of a bin in 1/16 sample units, corrected for the window gain
+uint32_t fftAmplitude(uint16_t bin)
+{
+  // the Hann window has a coherent gain of 1/2
+  uint8_t shift = FFT_INPUT_SHIFT - 4 - (fftWindow == FFT_HANN);
+  int32_t re, im;
+
+  if (!bin || (bin == FFT_POINTS)) {
+    re = bin ? fftData[0].im : fftData[0].re;
+    return abs(re) >> shift;
+  }
+  re = fftData[bin].re;
+  im = fftData[bin].im;
+  return isqrt64((int64_t)re * re + (int64_t)im * im) >> shift;
+}
+
+void fftReport(void)
+{
+  uint32_t scale = fftChannel ? pfCalibration.iscale : pfCalibration.uscale;
+  uint32_t rate = adcGetSampleRate();
+  uint16_t k;
+
+  printf("fft %c %s rate %u Hz\n", fftChannel ? 'I' : 'U',
+         (fftWindow == FFT_HANN) ? "hann" : "rect", rate);
+  printf("bin f_dHz peak_%s\n", fftChannel ? "uA" : "mV");
+  for (k = 0; k < FFT_BINS; k++) {
+    printf("%d %u %d\n", k, (uint32_t)((uint64_t)k * rate * 10 / FFT_SAMPLES),
+           (int32_t)(fixMulQ16(fftAmplitude(k), scale) >> 4));
+  }
+}
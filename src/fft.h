@@ -0,0 +1,33 @@
+#pragma once
+
+// Spectrum of one captured block of FFT_SAMPLES samples of U or I. The
+// block starts at a positive zero crossing, at PLL_SAMPLES per cycle it
+// covers exactly FFT_SAMPLES / PLL_SAMPLES cycles (12.5 Hz bins at 50 Hz)
+// and reaches up to the Nyquist frequency of the sample rate.
+#define FFT_BITS    9                       // complex points 2^FFT_BITS
+#define FFT_POINTS  (1 << FFT_BITS)
+#define FFT_SAMPLES (2 * FFT_POINTS)        // real input samples
+#define FFT_BINS    (FFT_POINTS + 1)        // DC to Nyquist
+
+enum {
+  FFT_RECT = 0,     // synchronous blocks, no leakage
+  FFT_HANN,         // asynchronous blocks and interharmonics
+  FFT_AUTO          // FFT_RECT if the sampling loop stayed locked
+};
+
+struct fftComplex {
+  int32_t re, im;
+};
+
+// samples are packed in pairs (even in re, odd in im) during capture, the
+// spectrum replaces them in place, Nyquist goes into the im of bin 0
+extern struct fftComplex fftData[FFT_POINTS];
+
+void fftRequest(uint8_t ch);
+void fftSample(int16_t u, int16_t i, bool crossed);
+bool fftReady(void);
+bool fftClaim(void);
+void fftRelease(void);
+void fftTransform(uint8_t window);
+uint32_t fftAmplitude(uint16_t bin);
+void fftReport(void);
@@ -0,0 +1,162 @@
+#include "board.h"
+
+// sin(2 pi k / FIX_SINE_STEPS) for k = 0..FIX_SINE_STEPS / 4, Q31
+static const int32_t fixSine[FIX_SINE_STEPS / 4 + 1] = {
+  0x00000000, 0x00c90f88, 0x01921d20, 0x025b26d7, 0x03242abf, 0x03ed26e6,
+  0x04b6195d, 0x057f0035, 0x0647d97c, 0x0710a345, 0x07d95b9e, 0x08a2009a,
+  0x096a9049, 0x0a3308bd, 0x0afb6805, 0x0bc3ac35, 0x0c8bd35e, 0x0d53db92,
+  0x0e1bc2e4, 0x0ee38766, 0x0fab272b, 0x1072a048, 0x1139f0cf, 0x120116d5,
+  0x12c8106f, 0x138edbb1, 0x145576b1, 0x151bdf86, 0x15e21445, 0x16a81305,
+  0x176dd9de, 0x183366e9, 0x18f8b83c, 0x19bdcbf3, 0x1a82a026, 0x1b4732ef,
+  0x1c0b826a, 0x1ccf8cb3, 0x1d934fe5, 0x1e56ca1e, 0x1f19f97b, 0x1fdcdc1b,
+  0x209f701c, 0x2161b3a0, 0x2223a4c5, 0x22e541af, 0x23a6887f, 0x24677758,
+  0x25280c5e, 0x25e845b6, 0x26a82186, 0x27679df4, 0x2826b928, 0x28e5714b,
+  0x29a3c485, 0x2a61b101, 0x2b1f34eb, 0x2bdc4e6f, 0x2c98fbba, 0x2d553afc,
+  0x2e110a62, 0x2ecc681e, 0x2f875262, 0x3041c761, 0x30fbc54d, 0x31b54a5e,
+  0x326e54c7, 0x3326e2c3, 0x33def287, 0x34968250, 0x354d9057, 0x36041ad9,
+  0x36ba2014, 0x376f9e46, 0x382493b0, 0x38d8fe93, 0x398cdd32, 0x3a402dd2,
+  0x3af2eeb7, 0x3ba51e29, 0x3c56ba70, 0x3d07c1d6, 0x3db832a6, 0x3e680b2c,
+  0x3f1749b8, 0x3fc5ec98, 0x4073f21d, 0x4121589b, 0x41ce1e65, 0x427a41d0,
+  0x4325c135, 0x43d09aed, 0x447acd50, 0x452456bd, 0x45cd358f, 0x46756828,
+  0x471cece7, 0x47c3c22f, 0x4869e665, 0x490f57ee, 0x49b41533, 0x4a581c9e,
+  0x4afb6c98, 0x4b9e0390, 0x4c3fdff4, 0x4ce10034, 0x4d8162c4, 0x4e210617,
+  0x4ebfe8a5, 0x4f5e08e3, 0x4ffb654d, 0x5097fc5e, 0x5133cc94, 0x51ced46e,
+  0x5269126e, 0x53028518, 0x539b2af0, 0x5433027d, 0x54ca0a4b, 0x556040e2,
+  0x55f5a4d2, 0x568a34a9, 0x571deefa, 0x57b0d256, 0x5842dd54, 0x58d40e8c,
+  0x59646498, 0x59f3de12, 0x5a82799a, 0x5b1035cf, 0x5b9d1154, 0x5c290acc,
+  0x5cb420e0, 0x5d3e5237, 0x5dc79d7c, 0x5e50015d, 0x5ed77c8a, 0x5f5e0db3,
+  0x5fe3b38d, 0x60686ccf, 0x60ec3830, 0x616f146c, 0x61f1003f, 0x6271fa69,
+  0x62f201ac, 0x637114cc, 0x63ef3290, 0x646c59bf, 0x64e88926, 0x6563bf92,
+  0x65ddfbd3, 0x66573cbb, 0x66cf8120, 0x6746c7d8, 0x67bd0fbd, 0x683257ab,
+  0x68a69e81, 0x6919e320, 0x698c246c, 0x69fd614a, 0x6a6d98a4, 0x6adcc964,
+  0x6b4af279, 0x6bb812d1, 0x6c242960, 0x6c8f351c, 0x6cf934fc, 0x6d6227fa,
+  0x6dca0d14, 0x6e30e34a, 0x6e96a99d, 0x6efb5f12, 0x6f5f02b2, 0x6fc19385,
+  0x7023109a, 0x708378ff, 0x70e2cbc6, 0x71410805, 0x719e2cd2, 0x71fa3949,
+  0x72552c85, 0x72af05a7, 0x7307c3d0, 0x735f6626, 0x73b5ebd1, 0x740b53fb,
+  0x745f9dd1, 0x74b2c884, 0x7504d345, 0x7555bd4c, 0x75a585cf, 0x75f42c0b,
+  0x7641af3d, 0x768e0ea6, 0x76d94989, 0x77235f2d, 0x776c4edb, 0x77b417df,
+  0x77fab989, 0x78403329, 0x78848414, 0x78c7aba2, 0x7909a92d, 0x794a7c12,
+  0x798a23b1, 0x79c89f6e, 0x7a05eead, 0x7a4210d8, 0x7a7d055b, 0x7ab6cba4,
+  0x7aef6323, 0x7b26cb4f, 0x7b5d039e, 0x7b920b89, 0x7bc5e290, 0x7bf88830,
+  0x7c29fbee, 0x7c5a3d50, 0x7c894bde, 0x7cb72724, 0x7ce3ceb2, 0x7d0f4218,
+  0x7d3980ec, 0x7d628ac6, 0x7d8a5f40, 0x7db0fdf8, 0x7dd6668f, 0x7dfa98a8,
+  0x7e1d93ea, 0x7e3f57ff, 0x7e5fe493, 0x7e7f3957, 0x7e9d55fc, 0x7eba3a39,
+  0x7ed5e5c6, 0x7ef05860, 0x7f0991c4, 0x7f2191b4, 0x7f3857f6, 0x7f4de451,
+  0x7f62368f, 0x7f754e80, 0x7f872bf3, 0x7f97cebd, 0x7fa736b4, 0x7fb563b3,
+  0x7fc25596, 0x7fce0c3e, 0x7fd8878e, 0x7fe1c76b, 0x7fe9cbc0, 0x7ff09478,
+  0x7ff62182, 0x7ffa72d1, 0x7ffd885a, 0x7fff6216, 0x7fffffff
+};
+
+// atan(2^-k) in 0.001 degree for the CORDIC
+static const int32_t fixAtanTable[] = {
+  45000, 26565, 14036, 7125, 3576, 1790, 895, 448, 224, 112, 56, 28, 14, 7, 3, 2, 1
+};
+
+uint32_t isqrt64(uint64_t x)
+{
+  uint64_t r = 0, bit = (uint64_t)1 << 62;
+
+  while (bit > x) {
+    bit >>= 2;
+  }
+  while (bit) {
+    if (x >= r + bit) {
+      x -= r + bit;
+      r = (r >> 1) + bit;
+    } else {
+      r >>= 1;
+    }
+    bit >>= 2;
+  }
+  return r;
+}
+
+// floor of the cube root of x < 2^63, bit by bit
+uint32_t icbrt64(uint64_t x)
+{
+  uint32_t r = 0;
+  int8_t b;
+
+  for (b = 20; b >= 0; b--) {
+    uint64_t t = r | (1UL << b);
+    if (t * t * t <= x) {
+      r = t;
+    }
+  }
+  return r;
+}
+
+// sum / n with frac fraction bits, without shifting the sum out of range
+int64_t fixMean(int64_t sum, uint32_t n, uint8_t frac)
+{
+  int64_t q, r;
+
+  if (!n) {
+    return 0;
+  }
+  q = sum / n;
+  r = sum % n;
+  return q * ((int64_t)1 << frac) + r * ((int64_t)1 << frac) / n;
+}
+
+// a * q16 >> 16 with a 96 bit intermediate, exact as long as the result
+// fits 63 bits (|a| * q16 < 2^79). Power goes through the U and I scales
+// one at a time, see pfPowerScale().
+int64_t fixMulQ16(int64_t a, uint32_t q16)
+{
+  uint64_t m = (a < 0) ? -a : a;
+  uint64_t r = ((m >> 32) * q16 << 16) + (((m & 0xffffffff) * q16) >> 16);
+  return (a < 0) ? -(int64_t)r : (int64_t)r;
+}
+
+int32_t fixSin(uint16_t k)
+{
+  k &= FIX_SINE_STEPS - 1;
+  if (k <= FIX_SINE_STEPS / 4) {
+    return fixSine[k];
+  } else if (k <= FIX_SINE_STEPS / 2) {
+    return fixSine[FIX_SINE_STEPS / 2 - k];
+  } else if (k <= FIX_SINE_STEPS * 3 / 4) {
+    return -fixSine[k - FIX_SINE_STEPS / 2];
+  }
+  return -fixSine[FIX_SINE_STEPS - k];
+}
+
+int32_t fixCos(uint16_t k)
+{
+  return fixSin(k + FIX_SINE_STEPS / 4);
+}
+
+// angle of (x, y) in 0.01 degree, -18000..17999
+int32_t fixAtan2(int32_t y, int32_t x)
+{
+  int64_t xx = x, yy = y, t;
+  int32_t a = 0;
+  uint8_t k;
+
+  if (!x && !y) {
+    return 0;
+  }
+  // the CORDIC converges within +-99 degrees, start from the right half
+  if (xx < 0) {
+    xx = -xx;
+    yy = -yy;
+    a = 180000;
+  }
+  for (k = 0; k < sizeof(fixAtanTable) / sizeof(fixAtanTable[0]); k++) {
+    if (yy > 0) {
+      t = xx + (yy >> k);
+      yy -= xx >> k;
+      a += fixAtanTable[k];
+    } else {
+      t = xx - (yy >> k);
+      yy += xx >> k;
+      a -= fixAtanTable[k];
+    }
+    xx = t;
+  }
+  if (a >= 180000) {
+    a -= 360000;
+  }
+  return (a + ((a < 0) ? -5 : 5)) / 10;
+}
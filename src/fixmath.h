@@ -0,0 +1,13 @@
+#pragma once
+
+// Integer helpers for the result path, the F103 has no FPU and nothing
+// after the ADC interrupt uses floats.
+#define FIX_SINE_STEPS 1024     // fixSin() steps per turn
+
+uint32_t isqrt64(uint64_t x);
+uint32_t icbrt64(uint64_t x);
+int64_t fixMean(int64_t sum, uint32_t n, uint8_t frac);
+int64_t fixMulQ16(int64_t a, uint32_t q16);
+int32_t fixSin(uint16_t k);
+int32_t fixCos(uint16_t k);
+int32_t fixAtan2(int32_t y, int32_t x);
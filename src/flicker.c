@@ -0,0 +1,350 @@
+#include "board.h"
+
+/*
+    Fixed point throughout. The ratio to the 1 minute mean square and the
+    filter signals are Q28, the squared and smoothed output is Q40 in 64
+    bits, Pinst is Q16. The biquads are direct form I with Q30
+    coefficients and the rounding error fed back into the next output,
+    the slow first order filters keep 16 extra bits of state instead.
+
+    Coefficients are the bilinear transform of the IEC 61000-4-15 s domain
+    filters, prewarped at the Butterworth cutoff and at 8.8Hz for the
+    weighting. The Butterworth is 35Hz for 50Hz mains and 42Hz for 60Hz,
+    which at 800Hz and 960Hz comes out the same. The scale makes Pinst
+    peak at 1.00 for 0.250% sinusoidal fluctuations at 8.8Hz through the
+    230V lamp chain, the 120V lamp then needs 0.321%.
+
+    The rate follows the sampling loop; on free running ADCs it is 800Hz.
+*/
+
+#define FLK_SETTLE_S 20           // high pass and mean square pull in
+#define FLK_GAP_HOLD 1            // s, filters ringing after a gap
+#define FLK_LAMP_120V 180000      // mV, declared voltages below use the 120V lamp
+
+struct flkBiquad {
+  int32_t b0, b1, b2, a1, a2;     // Q30, a0 = 1
+};
+
+struct flkRate {
+  uint16_t hz;
+  struct flkBiquad lp[3];
+  struct flkBiquad weight[2][2];  // 230V and 120V lamp
+  uint32_t msq;                   // 1 minute mean square, Q32
+  uint32_t hp;                    // 0.05Hz high pass, 1 - alpha, Q24
+  uint32_t smooth;                // 300ms, Q24
+  uint32_t scale;                 // Pinst Q16 = Q40 * scale >> 24
+};
+
+static const struct flkRate flkRates[2] = {
+  { 800, {
+      { 18833559, 37667119, 18833559, -1931183591, 932776005 },
+      { 16910864, 33821729, 16910864, -1734031428, 727933062 },
+      { 15969600, 31939201, 15969600, -1637514706, 627651284 }
+    }, {
+      { { 65336158, 0, -65336158, -2075805867, 1007441234 }, { 45907631, 815024, -45092607, -1967072577, 894960801 } },
+      { { 60570318, 0, -60570318, -2074198592, 1005738781 }, { 32633797, 745206, -31888592, -1999008087, 926756674 } },
+    },
+    89478, 6586, 69760, 309581
+  },
+  { 960, {
+      { 18833559, 37667119, 18833559, -1931183591, 932776005 },
+      { 16910864, 33821729, 16910864, -1734031428, 727933062 },
+      { 15969600, 31939201, 15969600, -1637514706, 627651284 }
+    }, {
+      { { 54742983, 0, -54742983, -2088178582, 1018190775 }, { 38737390, 573885, -38163505, -1995254729, 922660675 } },
+      { { 50756247, 0, -50756247, -2086810948, 1016757159 }, { 27456056, 523408, -26932648, -2022536711, 949841703 } },
+    },
+    74565, 5489, 58153, 309583
+  },
+};
+
+// 2^(j / FLK_PER_OCTAVE), Q15, the class edges within an octave
+static const uint16_t flkRoot[FLK_PER_OCTAVE] = { 32768, 36781, 41285, 46341, 52016, 58386 };
+
+struct flkState {
+  int32_t x1, x2, y1, y2;
+  int64_t err;
+};
+
+struct flkResults flkResults;
+
+static uint32_t flkAcc;
+static uint8_t  flkCount;
+static const struct flkRate *flkRate;
+static uint8_t  flkLamp;
+static int64_t  flkMsq;           // Q16 above the summed squares
+static int32_t  flkPrev;          // high pass input, Q28
+static int64_t  flkHp;            // Q44
+static struct flkState flkState[5];
+static int64_t  flkSmooth;        // Q40
+static uint16_t flkSettle;        // steps left before classifying
+static uint16_t flkHold;          // the same after a gap, without the fast pull in
+static uint32_t flkPinst;         // Q16, latest
+static uint32_t flkPinstMax;      // Q16, of the running interval
+
+static uint32_t flkClass[2][FLK_CLASSES];
+static uint8_t  flkActive;        // the other one is the last interval
+static uint32_t flkClassified;    // Pinst values in the active one
+static uint32_t flkSlot;          // 10 minute slot of the active one
+static volatile uint16_t flkSeq;  // intervals closed
+static uint16_t flkLastSeq;
+static uint32_t flkClosedCount, flkClosedSlot;
+static uint16_t flkClosedHz;
+
+static uint64_t flkPltSum;        // Pst^3 of the running 2 hours, 0.001^3
+static uint8_t  flkPltN;
+
+static const struct flkRate *flkSelect(void)
+{
+  uint32_t ps = adcGetSampleTime();
+
+  // 1e12 / 880Hz between 800Hz and 960Hz steps
+  return (ps && (ps * FLK_DECIMATION < 1136363636UL)) ? &flkRates[1] : &flkRates[0];
+}
+
+static void flkInit(void)
+{
+  flkRate = flkSelect();
+  flkLamp = (evtConfig.declared && (evtConfig.declared < FLK_LAMP_120V)) ? 1 : 0;
+  flkMsq = 0;
+  flkHp = 0;
+  memset(flkState, 0, sizeof(flkState));
+  flkSmooth = 0;
+  flkSettle = FLK_SETTLE_S * flkRate->hz;
+}
+
+// start the chain over, the running interval keeps what it has
+void flkRestart(void)
+{
+  __disable_irq();
+  flkInit();
+  __enable_irq();
+}
+
+// After a gap in the samples: drop the partial step, the next one starts
+// with the next sample. The jump in the fluctuation makes the filters ring,
+// Pinst is not classified until that has died down.
+void flkResync(void)
+{
+  flkAcc = 0;
+  flkCount = 0;
+  flkHold = FLK_GAP_HOLD * (flkRate ? flkRate->hz : 800);
+}
+
+static int32_t flkClamp(int64_t x)
+{
+  return constrain(x, -(1L << 29), 1L << 29);
+}
+
+static int32_t flkBiquad(const struct flkBiquad *c, struct flkState *s, int32_t x)
+{
+  int64_t acc = s->err;
+  int32_t y;
+
+  acc += (int64_t)c->b0 * x + (int64_t)c->b1 * s->x1 + (int64_t)c->b2 * s->x2;
+  acc -= (int64_t)c->a1 * s->y1 + (int64_t)c->a2 * s->y2;
+  y = flkClamp(acc >> 30);
+  s->err = acc - (int64_t)y * (1L << 30);
+  s->x2 = s->x1;
+  s->x1 = x;
+  s->y2 = s->y1;
+  s->y1 = y;
+  return y;
+}
+
+// class of a Q16 Pinst, class 0 is everything below 2^-8
+static uint8_t flkClassOf(uint32_t p)
+{
+  uint8_t msb, sub;
+  uint32_t mant;
+
+  if (p < (1 << 8)) {
+    return 0;
+  }
+  msb = 31 - __builtin_clz(p);
+  mant = ((uint64_t)p << 15) >> msb;
+  for (sub = 1; (sub < FLK_PER_OCTAVE) && (mant >= flkRoot[sub]); sub++);
+  return min(1 + (msb - 8) * FLK_PER_OCTAVE + sub - 1, FLK_CLASSES - 1);
+}
+
+// lower edge of a class, Q16
+static uint64_t flkEdge(uint8_t c)
+{
+  if (!c) {
+    return 0;
+  }
+  c--;
+  return ((uint64_t)flkRoot[c % FLK_PER_OCTAVE] << (c / FLK_PER_OCTAVE)) >> 7;
+}
+
+static void flkClose(uint32_t slot)
+{
+  flkClosedCount = flkClassified;
+  flkClosedSlot = flkSlot;
+  flkClosedHz = flkRate->hz;
+  flkActive ^= 1;
+  memset(flkClass[flkActive], 0, sizeof(flkClass[0]));
+  flkClassified = 0;
+  flkPinstMax = 0;
+  flkSlot = slot;
+  flkSeq++;
+}
+
+// one decimated step, x is the sum of FLK_DECIMATION squared samples
+static void flkStep(uint32_t x)
+{
+  const struct flkRate *r = flkSelect();
+  uint8_t lamp = (evtConfig.declared && (evtConfig.declared < FLK_LAMP_120V)) ? 1 : 0;
+  uint32_t slot = millis() / FLK_PST_MS;
+  int32_t n, y;
+  int64_t s;
+  uint8_t k;
+
+  if ((r != flkRate) || (lamp != flkLamp)) {
+    flkInit();
+  }
+  if (!flkMsq) {
+    flkMsq = (int64_t)x << 16;
+    flkPrev = 1L << 28;
+  }
+  if (flkSettle) {
+    // a single step may sit on a zero crossing, pull in within a second
+    flkMsq += (((int64_t)x << 16) - flkMsq) >> 9;
+  } else {
+    flkMsq += ((((int64_t)x << 16) - flkMsq) * r->msq) >> 32;
+  }
+
+  // relative to the mean square, the squaring demodulator is the input;
+  // over a sixteenth of a cycle it still swings 0..2 at twice the mains
+  n = (flkMsq >> 16) ? min(((int64_t)x << 28) / (flkMsq >> 16), 1L << 30) : 0;
+  flkHp += (int64_t)(n - flkPrev) * 65536 - ((flkHp * r->hp) >> 24);
+  flkPrev = n;
+  y = flkClamp(flkHp >> 16);
+  for (k = 0; k < 3; k++) {
+    y = flkBiquad(&r->lp[k], &flkState[k], y);
+  }
+  for (k = 0; k < 2; k++) {
+    y = flkBiquad(&r->weight[flkLamp][k], &flkState[3 + k], y);
+  }
+  s = ((int64_t)y * y) >> 16;
+  flkSmooth += ((s - flkSmooth) * r->smooth) >> 24;
+  flkPinst = min((uint64_t)flkSmooth * r->scale >> 24, UINT32_MAX);
+
+  if (slot != flkSlot) {
+    flkClose(slot);
+  }
+  if (flkSettle) {
+    flkSettle--;
+    return;
+  }
+  if (flkHold) {
+    flkHold--;
+    return;
+  }
+  flkPinstMax = max(flkPinstMax, flkPinst);
+  flkClass[flkActive][flkClassOf(flkPinst)]++;
+  flkClassified++;
+}
+
+// called for every sample from the ADC interrupt
+void flkSample(int16_t u)
+{
+  flkAcc += ((int32_t)u * u) >> 4;
+  if (++flkCount < FLK_DECIMATION) {
+    return;
+  }
+  PROFILE_START(t);
+  flkStep(flkAcc);
+  PROFILE_END(PROF_FLICKER, t);
+  flkAcc = 0;
+  flkCount = 0;
+}
+
+// Pinst exceeded for permille / 1000 of the interval, Q16, linear within
+// the class. Class 0 is below the resolution and reads as 0.
+static uint32_t flkPercentile(const uint32_t *cls, uint32_t n, uint16_t permille)
+{
+  uint64_t rank = (uint64_t)n * permille;     // in 1/1000 steps
+  uint64_t above = 0;
+  uint8_t c;
+
+  for (c = FLK_CLASSES - 1; c; c--) {
+    uint64_t m = (uint64_t)cls[c] * 1000;
+    if (above + m > rank) {
+      uint64_t lo = flkEdge(c), hi = flkEdge(c + 1);
+      return hi - (hi - lo) * (rank - above) / m;
+    }
+    above += m;
+  }
+  return 0;
+}
+
+static uint32_t flkPst(const uint32_t *cls, uint32_t n)
+{
+  // 0.1% to 80% in 0.1%, then the smoothed percentiles P1s .. P50s
+  static const uint16_t permille[] = { 1, 7, 10, 15, 22, 30, 40, 60, 80, 100, 130, 170, 300, 500, 800 };
+  uint64_t p[sizeof(permille) / sizeof(permille[0])];
+  uint64_t sq;
+  uint8_t k;
+
+  for (k = 0; k < sizeof(permille) / sizeof(permille[0]); k++) {
+    p[k] = flkPercentile(cls, n, permille[k]);
+  }
+  // weights in 0.0001, Pst^2 = sq / (10000 * 2^16)
+  sq = 314 * p[0] + 525 * (p[1] + p[2] + p[3]) / 3 + 657 * (p[4] + p[5] + p[6]) / 3 +
+       2800 * (p[7] + p[8] + p[9] + p[10] + p[11]) / 5 + 800 * (p[12] + p[13] + p[14]) / 3;
+  // in 1e-6, sq * 1e8 / 2^16 under the root
+  return (isqrt64((sq * 390625) >> 8) + 500) / 1000;
+}
+
+// Returns 1 when a 10 minute interval has closed and its Pst (and at the
+// end of 2 hours, Plt) is in flkResults.
+uint8_t flkWait(void)
+{
+  struct flkResults *r = &flkResults;
+  uint32_t n, slot;
+  uint16_t hz;
+  uint8_t ready;
+
+  if (flkSeq == flkLastSeq) {
+    return 0;
+  }
+  // the closed classes stay untouched for the next 10 minutes
+  __disable_irq();
+  flkLastSeq = flkSeq;
+  ready = flkActive ^ 1;
+  n = flkClosedCount;
+  slot = flkClosedSlot;
+  hz = flkClosedHz;
+  __enable_irq();
+
+  r->pst = n ? flkPst(flkClass[ready], n) : 0;
+  r->pstEnd = millis();
+  r->pstPartial = n < (FLK_PST_MS / 1000) * hz / 10 * 9;
+  if (n) {
+    flkPltSum += (uint64_t)r->pst * r->pst * r->pst;
+    flkPltN++;
+  }
+  if (!((slot + 1) % FLK_PLT_PST)) {
+    r->plt = flkPltN ? icbrt64(flkPltSum / flkPltN) : 0;
+    r->pltEnd = r->pstEnd;
+    r->pltCount = flkPltN;
+    flkPltSum = 0;
+    flkPltN = 0;
+  }
+  return 1;
+}
+
+void flkReport(void)
+{
+  struct flkResults *r = &flkResults;
+  uint32_t p = ((uint64_t)flkPinst * 1000 + 32768) >> 16;
+  uint32_t m = ((uint64_t)flkPinstMax * 1000 + 32768) >> 16;
+
+  printf("flicker %dV lamp at %d Hz%s, Pinst %u.%03u max %u.%03u\n",
+         flkLamp ? 120 : 230, flkRate ? flkRate->hz : 0, flkSettle ? " settling" : "",
+         p / 1000, p % 1000, m / 1000, m % 1000);
+  printf("Pst %u.%03u at %u ms%s, Plt %u.%03u of %d Pst at %u ms\n",
+         r->pst / 1000, r->pst % 1000, r->pstEnd, r->pstPartial ? " partial" : "",
+         r->plt / 1000, r->plt % 1000, r->pltCount, r->pltEnd);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+// IEC 61000-4-15 flickermeter on U. The squared samples are summed over
+// FLK_DECIMATION samples, the rest of the chain (normalisation, 0.05Hz
+// high pass, 35Hz/42Hz Butterworth, lamp-eye weighting, squaring and
+// 300ms smoothing) runs at 800Hz on 50Hz mains and 960Hz on 60Hz mains,
+// still from the ADC interrupt. Pinst is classified in log classes over
+// 10 minute intervals aligned with the aggregation, Pst comes from the
+// classes in the main loop and Plt from the Pst of each 2 hours.
+#define FLK_DECIMATION  16      // PLL_SAMPLES / 16 per cycle
+#define FLK_PER_OCTAVE  6
+#define FLK_OCTAVES     18      // Pinst 2^-8 .. 2^10
+#define FLK_CLASSES     (1 + FLK_OCTAVES * FLK_PER_OCTAVE)
+#define FLK_PST_MS      600000
+#define FLK_PLT_PST     12
+
+struct flkResults {
+  uint32_t pst;         // 0.001, last 10 minute interval
+  uint32_t pstEnd;      // millis() at its end
+  bool     pstPartial;  // not classified all along (start up, no mains)
+  uint32_t plt;         // 0.001, last 2 hours
+  uint32_t pltEnd;
+  uint8_t  pltCount;    // Pst values in it, FLK_PLT_PST once running
+};
+
+extern struct flkResults flkResults;
+
+void flkSample(int16_t u);
+void flkRestart(void);
+void flkResync(void);
+uint8_t flkWait(void);
+void flkReport(void);
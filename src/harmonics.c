@@ -0,0 +1,182 @@
+#include "board.h"
+
+/*
+    Goertzel recursion per order n (w = 2 pi n / PLL_SAMPLES):
+
+      s[k] = x[k] + 2 cos(w) s[k-1] - s[k-2]
+
+    After a block of PLL_SAMPLES samples the DFT bin is e^jw s1 - s2. The
+    state of the lowest order grows to about PLL_SAMPLES * 32768 / (2 sin w),
+    so blocks are kept to one cycle and the states fit in 32 bits with Q30
+    coefficients. Each sample costs the same 2 * HRM_ORDERS multiply-adds,
+    the block end adds one pass over the bins.
+*/
+
+#define HRM_Q 30
+
+#if FIX_SINE_STEPS % PLL_SAMPLES
+#error "the coefficients come from fixSin(), PLL_SAMPLES must divide FIX_SINE_STEPS"
+#endif
+
+struct hrmState {
+  int32_t s1, s2;
+};
+
+struct hrmResults hrmResults;
+
+static int32_t  hrmCoeff[HRM_ORDERS];   // 2 cos(w), Q30
+static int32_t  hrmSin[HRM_ORDERS];     // sin(w), Q30
+static struct hrmState hrmState[2][HRM_ORDERS];
+static uint16_t hrmPos;
+
+void hrmInit(void)
+{
+  uint8_t n;
+  for (n = 0; n < HRM_ORDERS; n++) {
+    // Q31 cos(w) is Q30 2 cos(w)
+    uint16_t k = (n + 1) * (FIX_SINE_STEPS / PLL_SAMPLES);
+    hrmCoeff[n] = fixCos(k);
+    hrmSin[n] = fixSin(k) >> (31 - HRM_Q);
+  }
+  hrmRestart();
+}
+
+// drop the running block, the next one starts with the next sample
+void hrmRestart(void)
+{
+  memset(hrmState, 0, sizeof(hrmState));
+  hrmPos = 0;
+}
+
+void hrmReset(struct hrmSums *h)
+{
+  memset(h, 0, sizeof(*h));
+}
+
+static inline void hrmStep(struct hrmState *st, int16_t x)
+{
+  uint8_t n;
+  for (n = 0; n < HRM_ORDERS; n++, st++) {
+    int32_t s = x + (int32_t)(((int64_t)hrmCoeff[n] * st->s1) >> HRM_Q) - st->s2;
+    st->s2 = st->s1;
+    st->s1 = s;
+  }
+}
+
+void hrmSample(struct hrmSums *h, int16_t u, int16_t i)
+{
+  int32_t re, im, fre[2], fim[2];
+  int64_t q;
+  uint8_t ch, n;
+
+  hrmStep(hrmState[0], u);
+  hrmStep(hrmState[1], i);
+  if (++hrmPos < PLL_SAMPLES) {
+    return;
+  }
+
+  for (ch = 0; ch < 2; ch++) {
+    for (n = 0; n < HRM_ORDERS; n++) {
+      struct hrmState *st = &hrmState[ch][n];
+      // cos(w) is half the coefficient
+      re = (int32_t)(((int64_t)hrmCoeff[n] * st->s1) >> (HRM_Q + 1)) - st->s2;
+      im = (int32_t)(((int64_t)hrmSin[n] * st->s1) >> HRM_Q);
+      h->re[ch][n] += re;
+      h->im[ch][n] += im;
+      if (!n) {
+        fre[ch] = re;
+        fim[ch] = im;
+      }
+    }
+  }
+  // fundamental U I* of this block, real part active, imaginary reactive
+  h->p1 += (int64_t)fre[0] * fre[1] + (int64_t)fim[0] * fim[1];
+  q = (int64_t)fim[0] * fre[1] - (int64_t)fre[0] * fim[1];
+  h->q1 += q;
+  if (q < 0) {
+    h->q1lead += q;
+  }
+  h->blocks++;
+  hrmRestart();
+}
+
+// add the window b to a, up to HRM_MAX_BLOCKS blocks in total
+void hrmMerge(struct hrmSums *a, const struct hrmSums *b)
+{
+  uint8_t ch, n;
+
+  for (ch = 0; ch < 2; ch++) {
+    for (n = 0; n < HRM_ORDERS; n++) {
+      a->re[ch][n] += b->re[ch][n];
+      a->im[ch][n] += b->im[ch][n];
+    }
+  }
+  a->p1 += b->p1;
+  a->q1 += b->q1;
+  a->q1lead += b->q1lead;
+  a->blocks += b->blocks;
+}
+
+// phase in 0.01 degree to 0.1 degree, wrapped to -1800..1799
+static int16_t hrmPhase(int32_t p)
+{
+  p = ((p + ((p < 0) ? -5 : 5)) / 10) % 3600;
+  if (p >= 1800) {
+    p -= 3600;
+  } else if (p < -1800) {
+    p += 3600;
+  }
+  return p;
+}
+
+// Magnitudes as RMS, phases of order n as phi(n) - n phi(U1) so they do
+// not depend on where the window started. THD covers orders 2..HRM_ORDERS.
+void hrmCompute(const struct hrmSums *h, bool locked)
+{
+  int32_t *rms[2] = { hrmResults.U, hrmResults.I };
+  int16_t *phase[2] = { hrmResults.phaseU, hrmResults.phaseI };
+  uint32_t scale[2] = { pfCalibration.uscale, pfCalibration.iscale };
+  uint16_t *thd[2] = { &hrmResults.thdU, &hrmResults.thdI };
+  int32_t ref;
+  uint8_t ch, n;
+
+  hrmResults.valid = locked && h->blocks;
+  if (!h->blocks) {
+    return;
+  }
+  ref = fixAtan2(h->im[0][0], h->re[0][0]);
+
+  for (ch = 0; ch < 2; ch++) {
+    uint64_t sum2 = 0;
+    uint32_t fundamental = 0;
+    for (n = 0; n < HRM_ORDERS; n++) {
+      int64_t re = h->re[ch][n], im = h->im[ch][n];
+      uint64_t mag2 = re * re + im * im;
+      uint32_t mag = isqrt64(mag2);
+      // a bin is amplitude * blocks * PLL_SAMPLES / 2, RMS in 1/256 sample
+      // units is then mag * sqrt(2) / blocks (sqrt(2) in Q16)
+      uint64_t q8 = ((uint64_t)mag * 92682 >> 16) / h->blocks;
+      rms[ch][n] = (fixMulQ16(q8, scale[ch]) + 128) >> 8;
+      phase[ch][n] = hrmPhase(fixAtan2(im, re) - (n + 1) * ref);
+      if (n) {
+        sum2 += mag2;
+      } else {
+        fundamental = mag;
+      }
+    }
+    *thd[ch] = fundamental ? min((uint64_t)isqrt64(sum2) * 10000 / fundamental, 0xffff) : 0;
+  }
+}
+
+void hrmReport(void)
+{
+  uint8_t n;
+
+  printf("harmonics %s THD U %d I %d (0.01%%)\n", hrmResults.valid ? "sync" : "async",
+         hrmResults.thdU, hrmResults.thdI);
+  printf("n U_mV phU I_uA phI (0.1deg)\n");
+  for (n = 0; n < HRM_ORDERS; n++) {
+    printf("%d %d %d %d %d\n", n + 1,
+           hrmResults.U[n], hrmResults.phaseU[n], hrmResults.I[n], hrmResults.phaseI[n]);
+  }
+}
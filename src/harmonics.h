@@ -0,0 +1,39 @@
+#pragma once
+
+// Harmonic analysis with a bank of Goertzel filters, one per order and
+// channel. The filters run over blocks of PLL_SAMPLES samples, i.e. one
+// mains cycle when the sampling loop is locked, so every harmonic falls
+// exactly on a bin. Block results are summed per measurement window.
+#ifndef HRM_ORDERS
+#define HRM_ORDERS 40
+#endif
+
+// a bin grows by up to 32768 * PLL_SAMPLES * 2 / pi per block (a full
+// scale square wave, whose fundamental is 4 / pi of its peak), the window
+// sums stay in 32 bits for 402 such blocks
+#define HRM_MAX_BLOCKS 384
+
+// window sums of the block DFTs, in sample units
+struct hrmSums {
+  int32_t  re[2][HRM_ORDERS], im[2][HRM_ORDERS];
+  int64_t  p1, q1;      // fundamental U I* summed per block
+  int64_t  q1lead;      // the part of q1 from blocks with Q < 0
+  uint16_t blocks;
+};
+
+struct hrmResults {
+  int32_t U[HRM_ORDERS], I[HRM_ORDERS];             // RMS of order n + 1, mV and uA
+  int16_t phaseU[HRM_ORDERS], phaseI[HRM_ORDERS];   // 0.1 degree, to the U fundamental
+  uint16_t thdU, thdI;                              // 0.01% of the fundamental
+  bool valid;                                       // window was synchronous
+};
+
+extern struct hrmResults hrmResults;
+
+void hrmInit(void);
+void hrmRestart(void);
+void hrmReset(struct hrmSums *h);
+void hrmSample(struct hrmSums *h, int16_t u, int16_t i);
+void hrmMerge(struct hrmSums *a, const struct hrmSums *b);
+void hrmCompute(const struct hrmSums *h, bool locked);
+void hrmReport(void);
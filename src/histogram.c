@@ -0,0 +1,195 @@
+#include "board.h"
+
+/*
+    histWindow() runs from the ADC interrupt at every window swap and only
+    queues the window's sums, histUpdate() converts and bins them from the
+    main loop. The queue holds HIST_QUEUE windows, so the windows the main
+    loop does not get to read are still counted as long as it comes round
+    within that; windows that find the queue full are counted as dropped.
+    Counts are 32 bit, 5 windows a second fill them in 27 years. Bin widths
+    are capped so that the whole range of a quantity stays in 32 bits.
+*/
+
+#define HIST_F_STEP 50          // mHz
+#define HIST_MAX_STEP (INT32_MAX / HIST_BINS)
+#define HIST_QUEUE  4
+
+struct histQueued {
+  struct pfSums s;
+  uint64_t fnum, fden;  // frequency in mHz is fnum / fden
+};
+
+static struct histogram hist[HIST_QUANTITIES];
+static struct histQueued histQueue[HIST_QUEUE];
+static volatile uint8_t histHead, histTail;   // written by histWindow(), histUpdate()
+static uint32_t histDropped;
+
+// the default range, x is the first value for the frequency
+static void histSetup(uint8_t q, int32_t x)
+{
+  struct histogram *h = &hist[q];
+  int32_t nominal;
+
+  switch (q) {
+  case HIST_U:
+    nominal = evtConfig.declared ? evtConfig.declared : 230000;
+    h->lo = nominal / 100 * 80;
+    h->step = max(nominal / 100 * 40 / HIST_BINS, 1);
+    break;
+  case HIST_I:
+    h->lo = 0;                  // 0..12A
+    h->step = 250000;
+    break;
+  case HIST_P:
+    h->lo = -2400000;           // +-2.4kW
+    h->step = 100000;
+    break;
+  default:
+    nominal = (x > 55000) ? 60000 : 50000;
+    h->lo = nominal - HIST_F_STEP * HIST_BINS / 2;
+    h->step = HIST_F_STEP;
+    break;
+  }
+}
+
+static void histAdd(uint8_t q, int32_t x)
+{
+  struct histogram *h = &hist[q];
+
+  if (!h->step) {
+    histSetup(q, x);
+  }
+  if (x < h->lo) {
+    h->under++;
+  } else if (((int64_t)x - h->lo) / h->step >= HIST_BINS) {
+    h->over++;
+  } else {
+    h->bin[((int64_t)x - h->lo) / h->step]++;
+  }
+  h->total++;
+}
+
+// called from the ADC interrupt with the sums of every window and its
+// frequency in mHz as fnum / fden, fden 0 if unknown
+void histWindow(const struct pfSums *s, uint64_t fnum, uint64_t fden)
+{
+  struct histQueued *e = &histQueue[histHead % HIST_QUEUE];
+
+  if ((uint8_t)(histHead - histTail) >= HIST_QUEUE) {
+    histDropped++;
+    return;
+  }
+  e->s = *s;
+  e->fnum = fnum;
+  e->fden = fden;
+  histHead++;
+}
+
+// bins the queued windows, from the main loop
+void histUpdate(void)
+{
+  while (histTail != histHead) {
+    struct histQueued *e = &histQueue[histTail % HIST_QUEUE];
+    struct pfPower p;
+
+    pfSumsToPower(&e->s, &p);
+    histAdd(HIST_U, p.Urms);
+    histAdd(HIST_I, p.Irms);
+    histAdd(HIST_P, p.powerW);
+    if (e->fden) {
+      histAdd(HIST_F, e->fnum / e->fden);
+    }
+    histTail++;
+  }
+}
+
+// New bin width for one quantity around the same centre, I keeps starting
+// at 0. Clears its counts, step 0 goes back to the default range.
+void histSetStep(uint8_t q, int32_t step)
+{
+  struct histogram *h = &hist[q];
+  int32_t centre;
+
+  if (q >= HIST_QUANTITIES) {
+    return;
+  }
+  step = min(step, HIST_MAX_STEP);
+  if (!h->step) {
+    histSetup(q, pfResults.frequency);
+  }
+  centre = h->lo + h->step * (HIST_BINS / 2);
+  memset(h, 0, sizeof(*h));
+  if (step > 0) {
+    h->step = step;
+    h->lo = (q == HIST_I) ? 0 : centre - step * (HIST_BINS / 2);
+  }
+}
+
+// clears the counts, the ranges stay
+void histReset(void)
+{
+  uint8_t q;
+
+  for (q = 0; q < HIST_QUANTITIES; q++) {
+    struct histogram *h = &hist[q];
+    h->under = h->over = h->total = 0;
+    memset(h->bin, 0, sizeof(h->bin));
+  }
+  histTail = histHead;
+  histDropped = 0;
+}
+
+// a copy of one quantity with the queued windows binned
+void histGet(uint8_t q, struct histogram *h)
+{
+  histUpdate();
+  *h = hist[q];
+}
+
+// Value below which permille / 1000 of the windows fell, linear within the
+// bin. Ranks in the under or overflow give the edge of the range.
+int32_t histPercentile(const struct histogram *h, uint16_t permille)
+{
+  uint64_t rank = (uint64_t)h->total * permille;   // in 1/1000 windows
+  uint64_t below = (uint64_t)h->under * 1000;
+  uint8_t k;
+
+  if (!h->total || (rank < below)) {
+    return h->lo;
+  }
+  for (k = 0; k < HIST_BINS; k++) {
+    uint64_t n = (uint64_t)h->bin[k] * 1000;
+    if (rank < below + n) {
+      return h->lo + (int64_t)h->step * k + (int64_t)h->step * (rank - below) / n;
+    }
+    below += n;
+  }
+  return h->lo + (int64_t)h->step * HIST_BINS;
+}
+
+// The windows dropped from a full queue, then two lines per quantity:
+//   Bdropped n
+//   B<q> lo step total under over bin0 .. bin47
+//   P<q> p1 p5 p50 p95 p99
+void histReport(void)
+{
+  static const char name[HIST_QUANTITIES] = { 'U', 'I', 'P', 'f' };
+  static const uint16_t permille[] = { 10, 50, 500, 950, 990 };
+  struct histogram h;
+  uint8_t q, k;
+
+  histUpdate();
+  printf("Bdropped %u\n", histDropped);
+  for (q = 0; q < HIST_QUANTITIES; q++) {
+    histGet(q, &h);
+    printf("B%c %d %d %u %u %u", name[q], h.lo, h.step, h.total, h.under, h.over);
+    for (k = 0; k < HIST_BINS; k++) {
+      printf(" %u", h.bin[k]);
+    }
+    printf("\nP%c", name[q]);
+    for (k = 0; k < sizeof(permille) / sizeof(permille[0]); k++) {
+      printf(" %d", histPercentile(&h, permille[k]));
+    }
+    printf("\n");
+  }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+// Distributions of the window Urms, Irms, P and frequency over any length
+// of time in constant memory: HIST_BINS linear bins per quantity plus
+// under and overflow counts, percentiles are interpolated within a bin.
+// The I range starts at 0, P is centred on 0.
+// The U range defaults to 80..120% of the declared voltage (evtConfig),
+// the frequency range to +-1.2Hz around 50 or 60Hz, whichever the first
+// window is closer to.
+#define HIST_BINS 48
+
+enum {
+  HIST_U = 0,   // mV
+  HIST_I,       // uA
+  HIST_P,       // mW
+  HIST_F,       // mHz
+  HIST_QUANTITIES
+};
+
+struct histogram {
+  int32_t  lo, step;    // lower edge and bin width, step 0 until set up
+  uint32_t under, over;
+  uint32_t total;
+  uint32_t bin[HIST_BINS];
+};
+
+void histWindow(const struct pfSums *s, uint64_t fnum, uint64_t fden);
+void histUpdate(void);
+void histSetStep(uint8_t q, int32_t step);
+void histReset(void);
+void histGet(uint8_t q, struct histogram *h);
+int32_t histPercentile(const struct histogram *h, uint16_t permille);
+void histReport(void);
@@ -0,0 +1,199 @@
+#include "board.h"
+
+/*
+    inrSample() and inrHalfCycle() run from the ADC interrupt, on the
+    samples and half cycle boundaries of powerfactor.c. While armed the
+    peak of the running half cycle is kept so the half cycle the threshold
+    is crossed in is recorded whole. Half cycles are stored in sample
+    units, everything else is worked out once in inrWait().
+
+    Times within the recording are counted in mean half cycles, the
+    recording as a whole is timed with micros().
+
+    The log lives in the FFT buffer (INR_MAX_HALVES * 4 of its 4096 bytes),
+    claimed from inrArm() until inrStop(), so the mode costs no RAM while
+    it is off. It shares the buffer with the recorder the same way. Once
+    the half cycles of a recording have been printed the log is dropped
+    and the buffer goes back to the FFT, the summary stays.
+*/
+
+struct inrHalf {
+  uint16_t peak;        // sample units, |I|
+  uint16_t rms;
+};
+
+struct inrConfig inrConfig = { 20000, 2000, 10 };
+struct inrResults inrResults;
+
+// the FFT buffer while it is claimed, see fftClaim()
+static struct inrHalf *const inrLog = (struct inrHalf *)fftData;
+static volatile uint8_t inrStatus;
+static bool     inrFresh;         // done and not yet through inrWait()
+static int16_t  inrLevel;         // sample units
+static uint16_t inrPeak;          // of the running half cycle
+static uint16_t inrHalves;
+static int64_t  inrSumI2;
+static uint32_t inrSamples;
+static uint32_t inrTime;          // us recorded
+static uint32_t inrLast;          // micros() at the last boundary
+
+// false when the FFT buffer is in use elsewhere
+bool inrArm(const struct inrConfig *c)
+{
+  int64_t level;
+
+  if ((inrStatus == INR_OFF) && !fftClaim()) {
+    return false;
+  }
+  __disable_irq();
+  inrConfig = *c;
+  inrConfig.ms = constrain(c->ms, 20, INR_MAX_MS);
+  level = ((int64_t)c->threshold * 1000 << 16) / pfCalibration.iscale;
+  inrLevel = constrain(level, 1, 32767);
+  inrPeak = 0;
+  inrHalves = 0;
+  inrSumI2 = 0;
+  inrSamples = 0;
+  inrTime = 0;
+  inrFresh = false;
+  inrStatus = INR_ARMED;
+  __enable_irq();
+  return true;
+}
+
+// drop the recording and give the buffer back to the FFT
+void inrStop(void)
+{
+  if (inrStatus != INR_OFF) {
+    inrStatus = INR_OFF;
+    fftRelease();
+  }
+}
+
+uint8_t inrState(void)
+{
+  return inrStatus;
+}
+
+// called for every sample from the ADC interrupt
+void inrSample(int16_t i)
+{
+  uint16_t a = abs(i);
+
+  if ((inrStatus != INR_ARMED) && (inrStatus != INR_RUNNING)) {
+    return;
+  }
+  if ((inrStatus == INR_ARMED) && (a >= inrLevel)) {
+    inrResults.start = millis();
+    inrStatus = INR_RUNNING;
+  }
+  inrPeak = max(inrPeak, a);
+}
+
+// called from the ADC interrupt with the sums of every half cycle
+void inrHalfCycle(const struct pfSums *h)
+{
+  uint32_t now = micros();
+  uint32_t us = now - inrLast;
+  struct inrHalf *e;
+
+  inrLast = now;
+  if (inrStatus != INR_RUNNING) {
+    inrPeak = 0;
+    return;
+  }
+  e = &inrLog[inrHalves++];
+  e->peak = inrPeak;
+  e->rms = h->samples ? min((isqrt64(fixMean(h->sumI2, h->samples, 16)) + 128) >> 8, 0xffff) : 0;
+  inrPeak = 0;
+  inrSumI2 += h->sumI2;
+  inrSamples += h->samples;
+  inrTime += us;
+  if ((inrHalves == INR_MAX_HALVES) || (inrTime >= inrConfig.ms * 1000UL)) {
+    inrFresh = true;
+    inrStatus = INR_DONE;
+  }
+}
+
+static int32_t inrMicroAmps(uint32_t units)
+{
+  return fixMulQ16(units, pfCalibration.iscale);
+}
+
+// returns 1 once when a recording has completed, with inrResults filled in
+uint8_t inrWait(void)
+{
+  struct inrResults *r = &inrResults;
+  uint16_t n, top = 0, last;
+  uint32_t band, final, ma;
+
+  if ((inrStatus != INR_DONE) || !inrFresh) {
+    return 0;
+  }
+  inrFresh = false;
+
+  // the log is not written once done
+  for (n = 1; n < inrHalves; n++) {
+    if (inrLog[n].peak > inrLog[top].peak) {
+      top = n;
+    }
+  }
+  r->halves = inrHalves;
+  r->duration = inrTime / 1000;
+  r->peak = inrMicroAmps(inrLog[top].peak);
+  r->peakTime = (uint64_t)inrTime * top / inrHalves / 1000;
+  r->rms = 0;
+  for (n = 0; n < inrHalves; n++) {
+    r->rms = max(r->rms, inrMicroAmps(inrLog[n].rms));
+  }
+
+  // the last full cycle, or the last half cycle if that is all there is
+  last = inrHalves - 1;
+  final = inrLog[last].rms;
+  if (last) {
+    final = isqrt64(((uint64_t)final * final + (uint64_t)inrLog[last - 1].rms * inrLog[last - 1].rms) / 2);
+  }
+  r->final = inrMicroAmps(final);
+
+  // settled after the last half cycle outside the band
+  band = final * inrConfig.settle / 100;
+  r->settle = 0;
+  for (n = inrHalves; n--;) {
+    if (abs((int32_t)inrLog[n].rms - (int32_t)final) > (int32_t)band) {
+      r->settle = (uint64_t)inrTime * (n + 1) / inrHalves / 1000;
+      break;
+    }
+  }
+
+  // 0.001 A2s = mA2 * us / 1e9
+  ma = (fixMulQ16(isqrt64(fixMean(inrSumI2, inrSamples, 16)), pfCalibration.iscale) + 128000) / 256000;
+  r->i2t = ((uint64_t)ma * ma * inrTime + 500000000) / 1000000000;
+  return 1;
+}
+
+void inrReport(bool table)
+{
+  static const char *state[] = { "off", "armed", "recording", "done" };
+  struct inrResults *r = &inrResults;
+  uint16_t n;
+
+  printf("inrush %s threshold %d mA for %d ms, settled within %d%%\n",
+         state[inrStatus], inrConfig.threshold, inrConfig.ms, inrConfig.settle);
+  if (inrStatus != INR_DONE) {
+    return;
+  }
+  printf("at %u ms: peak %d uA after %u ms, RMS(1/2) max %d uA final %d uA\n",
+         r->start, r->peak, r->peakTime, r->rms, r->final);
+  printf("I2t %u.%03d A2s, settled after %u ms, %d half cycles in %u ms\n",
+         r->i2t / 1000, r->i2t % 1000, r->settle, r->halves, r->duration);
+  if (!table) {
+    printf("J prints the half cycles and frees the fft buffer, i drops them\n");
+    return;
+  }
+  printf("n peak_uA rms_uA\n");
+  for (n = 0; n < inrHalves; n++) {
+    printf("%d %d %d\n", n, inrMicroAmps(inrLog[n].peak), inrMicroAmps(inrLog[n].rms));
+  }
+  inrStop();
+  printf("fft buffer free\n");
+}
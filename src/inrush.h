@@ -0,0 +1,44 @@
+#pragma once
+
+// Inrush current: armed on a current threshold, records the peak and RMS
+// current of every half cycle from the one the threshold was crossed in,
+// for the configured time. The windowed RMS averages a switch-on away,
+// this keeps its shape and reports the peak, I2t and the settling time.
+#define INR_MAX_HALVES 400      // 4s at 50Hz, 3.3s at 60Hz
+#define INR_MAX_MS     4000
+
+enum {
+  INR_OFF = 0,
+  INR_ARMED,
+  INR_RUNNING,
+  INR_DONE
+};
+
+struct inrConfig {
+  uint32_t threshold;   // mA, instantaneous |I| that starts the recording
+  uint16_t ms;          // recording length
+  uint8_t  settle;      // % of the final RMS that counts as settled
+};
+
+struct inrResults {
+  uint32_t start;       // millis() at the trigger
+  uint32_t duration;    // ms recorded
+  int32_t  peak;        // uA, highest |I|
+  uint32_t peakTime;    // ms, start of the half cycle with the peak
+  int32_t  rms;         // uA, highest half cycle RMS
+  int32_t  final;       // uA, RMS of the last cycle recorded
+  uint32_t i2t;         // 0.001 A2s over the recording
+  uint32_t settle;      // ms until the half cycle RMS stays settled
+  uint16_t halves;
+};
+
+extern struct inrConfig inrConfig;
+extern struct inrResults inrResults;
+
+bool inrArm(const struct inrConfig *c);
+void inrStop(void);
+uint8_t inrState(void);
+void inrSample(int16_t i);
+void inrHalfCycle(const struct pfSums *h);
+uint8_t inrWait(void);
+void inrReport(bool table);
@@ -11,70 +11,368 @@ static void _putc(void *p, char c)
 }
 
 
+#define UART_MAX_ARGS 5
+
+// sets the event thresholds given, in the order of struct evtConfig
+static void eventConfig(const uint32_t *arg, uint8_t args)
+{
+  struct evtConfig config = evtConfig;
+
+  if (args > 0) {
+    config.declared = arg[0] * 1000;
+  }
+  if (args > 1) {
+    config.sag = min(arg[1], 255);
+  }
+  if (args > 2) {
+    config.swell = min(arg[2], 255);
+  }
+  if (args > 3) {
+    config.interruption = min(arg[3], 255);
+  }
+  if (args > 4) {
+    config.hysteresis = min(arg[4], 255);
+  }
+  evtSetConfig(&config);
+}
+
+// arms the recorder: trigger, level (V for U, mA for I), slope, pre %, divider
+static void recorderArm(const uint32_t *arg, uint8_t args)
+{
+  struct recConfig config = recConfig;
+
+  if (args > 0) {
+    config.trigger = min(arg[0], 255);
+  }
+  if (args > 1) {
+    config.level = arg[1] * 1000;
+  }
+  if (args > 2) {
+    config.slope = min(arg[2], 255);
+  }
+  if (args > 3) {
+    config.pre = min(arg[3], 255);
+  }
+  if (args > 4) {
+    config.divider = min(arg[4], 255);
+  }
+  if (!recArm(&config)) {
+    printf("fft buffer in use\n");
+  }
+}
+
+// arms the inrush recording: threshold mA, ms, settled %
+static void inrushArm(const uint32_t *arg, uint8_t args)
+{
+  struct inrConfig config = inrConfig;
+
+  if (args > 0) {
+    config.threshold = arg[0];
+  }
+  if (args > 1) {
+    config.ms = arg[1];
+  }
+  if (args > 2) {
+    config.settle = min(arg[2], 100);
+  }
+  if (!inrArm(&config)) {
+    printf("fft buffer in use\n");
+  }
+}
+
+// histogram bin width: quantity (see histogram.h), step in mV, mA, W or
+// mHz; without a step only the counts are cleared
+static void histogramStep(const uint32_t *arg, uint8_t args)
+{
+  static const uint16_t unit[HIST_QUANTITIES] = { 1, 1000, 1000, 1 };
+
+  if (args < 2) {
+    histReset();
+  } else if (arg[0] < HIST_QUANTITIES) {
+    histSetStep(arg[0], arg[1] * unit[arg[0]]);
+  }
+}
+
+static void calibrationSave(void)
+{
+  bool ok;
+
+  pfPause();
+  ok = flashSave(FLASH_CONFIG_PAGE, &pfCalibration, sizeof(pfCalibration), PF_CALIBRATION_VERSION);
+  pfResume();
+  printf(ok ? "Calibration saved\n" : "Calibration save failed\n");
+}
+
+// gains from a reference reading of the present signal, U in 10mV and I
+// in mA, 0 leaves a channel as it is
+static void gainCalibrate(const uint32_t *arg, uint8_t args)
+{
+  if (!arg[0] && ((args < 2) || !arg[1])) {
+    pfCalibrationReport();    // nothing to change, leave the flash alone
+    return;
+  }
+  if (!pfCalibrateGain(arg[0] * 10, (args > 1) ? arg[1] * 1000 : 0)) {
+    printf("no reading to calibrate against\n");
+    return;
+  }
+  pfCalibrationReport();
+  calibrationSave();
+}
+
+// phase correction in 0.01 degrees and the channel to delay, 0 for U
+// when the current chain lags, 1 for I
+static void phaseCalibrate(const uint32_t *arg, uint8_t args)
+{
+  int16_t centidegrees = min(arg[0], PF_MAX_PHASE);
+
+  pfSetPhaseCorrection(((args > 1) && arg[1]) ? -centidegrees : centidegrees);
+  pfCalibrationReport();
+  calibrationSave();
+}
+
+// single character commands over the UART, settings take decimal
+// arguments typed in front of them, separated by commas (e.g. "500u" for
+// a 500ms refresh, "230,90,110n" for events at 90% and 110% of 230V)
+void uartCommand(uint8_t c)
+{
+  static uint32_t arg[UART_MAX_ARGS];
+  static uint8_t  args = 0;     // values typed so far
+  static bool     next = true;  // the next digit starts a new value
+  struct pfConfig config = pfConfig;
+
+  if ((c >= '0') && (c <= '9')) {
+    if (next && (args < UART_MAX_ARGS)) {
+      arg[args++] = 0;
+    }
+    next = false;
+    if (args) {
+      arg[args - 1] = min(arg[args - 1] * 10 + (c - '0'), 0xffff);
+    }
+    return;
+  }
+  if (c == ',') {
+    next = true;
+    return;
+  }
+  if (!args) {
+    arg[0] = 0;
+  }
+  switch (c) {
+  case 'w':
+    config.cycles = arg[0];     // window in cycles, 0 for the default
+    config.ms = 0;
+    pfSetConfig(&config);
+    pfConfigReport();
+    break;
+  case 'm':
+    config.cycles = 0;          // window in ms
+    config.ms = arg[0];
+    pfSetConfig(&config);
+    pfConfigReport();
+    break;
+  case 'u':
+    config.refresh = arg[0];    // ms between results, 0 for every window
+    pfSetConfig(&config);
+    pfConfigReport();
+    break;
+  case 'v':
+    config.averaging = arg[0];  // 0 last window, 1 all windows since the last result
+    pfSetConfig(&config);
+    pfConfigReport();
+    break;
+  case 'l':
+    slideSetCycles(arg[0]);     // stream N cycle sliding results, 0 stops
+    printf("sliding %d cycles\n", slideGetCycles());
+    break;
+  case 'P':
+    profileReport();
+    break;
+  case 'Z':
+    profileReset();
+    break;
+  case 'O':
+    pfOffsetReset();
+    break;
+  case 'A':
+    aggregateReport();
+    break;
+  case 'E':
+    energyReport();
+    break;
+  case 'Q':
+    pfPowerReport();
+    break;
+  case 'T':
+    pfCycleReport();
+    break;
+  case 'S':
+    printf(energySave() ? "Energy saved\n" : "Energy save failed\n");
+    break;
+  case 'H':
+    hrmReport();
+    break;
+  case 'F':
+    fftRequest(0);  // spectrum of U, printed once captured
+    break;
+  case 'f':
+    fftRequest(1);  // spectrum of I
+    break;
+#ifdef FLOAT_DEBUG
+  case 'D':
+    pfFloatReport();
+    break;
+#endif
+  case 'C':
+    pfCaptureCalibration();
+    pfCalibrationReport();
+    calibrationSave();
+    break;
+  case 'c':
+    gainCalibrate(arg, args);   // e.g. "23000,5000c" for 230.00V and 5.000A
+    break;
+  case 'p':
+    phaseCalibrate(arg, args);  // e.g. "150p" delays U by 1.5 degrees, "150,1p" delays I
+    break;
+  case 'n':
+    eventConfig(arg, args);     // declared V, sag, swell, interruption, hysteresis %
+    evtReport();
+    break;
+  case 'N':
+    evtReport();
+    break;
+  case 'k':
+    recorderArm(arg, args);
+    recReport();
+    break;
+  case 'K':
+    recReport();
+    break;
+  case 'x':
+    recForce();
+    break;
+  case 'X':
+    recDump();      // binary, see recorder.c
+    break;
+  case 'y':
+    recStop();
+    break;
+  case 'j':
+    inrushArm(arg, args);
+    inrReport(false);
+    break;
+  case 'J':
+    inrReport(true);    // with every half cycle, then frees the fft buffer
+    break;
+  case 'i':
+    inrStop();
+    break;
+  case 'G':
+    shapeReport();
+    break;
+  case 'g':
+    shapeReset();
+    break;
+  case 'B':
+    histReport();
+    break;
+  case 'V':
+    flkReport();
+    break;
+  case 'b':
+    histogramStep(arg, args);
+    break;
+  default:
+    break;
+  }
+  args = 0;
+  next = true;
+}
+
 void checkBootLoaderEntry(bool wait)
 {
   uint32_t start = millis();
   do {
-    if (uartAvailable() && ('R' == uartRead())) {
-      lcdClear();
-      lcdWriteLine(0, "Entering bootloader.");
-      systemReset(true);
-      while (1);
+    if (uartAvailable()) {
+      uint8_t c = uartRead();
+      if ('R' == c) {
+        lcdClear();
+        lcdWriteLine(0, "Entering bootloader.");
+        systemReset(true);
+        while (1);
+      }
+      uartCommand(c);
     }
   }  while (wait && ((millis() - start) < 2000));
 }
 
-void calibrate()
-{
-  uint8_t i = 0;
-  char line[21];
-  line[1] = 0;
-  lcdClear();
-  lcdWriteLine(0,"Calibrating ADC");
-  pfCalibrateStart();
-  while ((i=pfCalibrating())) {
-    sprintf(line,"%03d%%",i);
-    lcdWriteLine(1,line);
-    checkBootLoaderEntry(false);
-    delay(100);
-  }
-  lcdWriteLine(1,"READY");
-  delay(500);
-}
-
 char line[21];
 
 int main(void)
 {
   systemInit();
+  profileInit();
   init_printf(NULL, _putc);
   uartInit(115200);
   lcdInit();
-  checkBootLoaderEntry(true);
+  // 'R' is also handled from the main loop, no need to wait for it here
+  checkBootLoaderEntry(false);
   ledInit();
   // rotaryInit();
-  adcInit(handleValuesFromADC);
-  delay(10);
-  printf("Initializing...\n");
-  calibrate();
+  if (flashLoad(FLASH_CONFIG_PAGE, &pfCalibration, sizeof(pfCalibration), PF_CALIBRATION_VERSION)) {
+    pfApplyCalibration();
+    printf("Calibration loaded\n");
+  }
+  if (energyLoad()) {
+    printf("Energy loaded\n");
+  }
+  adcInit(handleBlockFromADC);
   printf("Running...\n");
   // loop
   pfStartMeasure();
   while (1) {
     uint8_t result;
+    PROFILE_IDLE_START(ti);
     delay(10);
+    PROFILE_IDLE_END(ti);
     checkBootLoaderEntry(false);
+    energyUpdate();
+    histUpdate();
+
+    if (slideWait()) {
+      slideReport();
+    }
+
+    if (inrWait()) {
+      inrReport(false);
+    }
+
+    if (flkWait()) {
+      flkReport();
+    }
+
+    if (fftReady()) {
+      PROFILE_START(tf);
+      fftTransform(FFT_AUTO);
+      PROFILE_END(PROF_FFT, tf);
+      fftReport();
+    }
 
+    PROFILE_START(tw);
     result = pfWaitMeasure();
     if (result) {
+      // only count the calls that computed results
+      PROFILE_END(PROF_RESULTS, tw);
       if (result > 1) {
         lcdClear();
 	sprintf(line,"Error %d", result);
 	lcdWriteLine(0,line);
+	PROFILE_IDLE_START(te);
 	delay(500);
+	PROFILE_IDLE_END(te);
       } else {
-        int16_t t1,t2,t3,t4;
+        int32_t t1,t2,t3,t4;
         char   s1,s2;
+        PROFILE_START(tl);
         lcdClear();
 
         //  01234567890123456789
@@ -83,25 +381,25 @@ int main(void)
         //3 0000.0W   0000.0VA
         //4 00.0Hz pf=0.00
 
-        t1 = abs(pfResults.Urms * 10);
+        t1 = abs(pfResults.power.Urms) / 100;
         t2 = t1 % 10;
         t1 = t1 / 10;
-        s1 = (pfResults.Urms < 0)?'-':' ';
+        s1 = (pfResults.power.Urms < 0)?'-':' ';
 
-        t3 = abs(pfResults.Irms * 100);
+        t3 = abs(pfResults.power.Irms) / 10000;
         t4 = t3 % 100;
         t3 = t3 / 100;
-        s2 = (pfResults.Irms < 0)?'-':' ';
+        s2 = (pfResults.power.Irms < 0)?'-':' ';
 
         sprintf(line,"%c%03d.%01d Vr  %c%02d.%02d Ar",
                 s1,t1,t2,s2,t3,t4);
         lcdWriteLine(0,line);
 
-        t1 = abs(pfResults.Upp * 10);
+        t1 = abs(pfResults.Upp) / 100;
         t2 = t1 % 10;
         t1 = t1 / 10;
         s1 = (pfResults.Upp < 0)?'-':' ';
-        t3 = abs(pfResults.Ipp * 100);
+        t3 = abs(pfResults.Ipp) / 10000;
         t4 = t3 % 100;
         t3 = t3 / 100;
         s2 = (pfResults.Ipp < 0)?'-':' ';
@@ -109,31 +407,30 @@ int main(void)
                 s1,t1,t2,s2,t3,t4);
         lcdWriteLine(1,line);
 
-        t1 = abs(pfResults.powerW * 10);
+        t1 = abs(pfResults.power.powerW) / 100;
         t2 = t1 % 10;
         t1 = t1 / 10;
-        s1 = (pfResults.powerW < 0)?'-':' ';
-        t3 = abs(pfResults.powerVA * 10);
+        s1 = (pfResults.power.powerW < 0)?'-':' ';
+        t3 = abs(pfResults.power.powerVA) / 100;
         t4 = t3 % 10;
         t3 = t3 / 10;
-        s2 = (pfResults.powerVA < 0)?'-':' ';
+        s2 = (pfResults.power.powerVA < 0)?'-':' ';
         sprintf(line,"%c%04d.%01d W %c%04d.%01d VA",
                 s1,t1,t2,s2,t3,t4);
 
         lcdWriteLine(2,line);
-        t1 = pfResults.frequency * 10;
+        t1 = pfResults.frequency / 100;
         t2 = t1 % 10;
         t1 = t1 / 10;
-        t3 = abs(pfResults.powerFactor * 100);
+        t3 = abs(pfResults.power.powerFactor) / 10;
         t4 = t3 % 100;
         t3 = t3 / 100;
-        s2 = (pfResults.powerFactor < 0)?'-':' ';
-        sprintf(line,"%3d.%1dHz pf=%4d.%2d",
+        s2 = (pfResults.power.powerFactor < 0)?'-':' ';
+        sprintf(line,"%3d.%1dHz pf=%c%1d.%02d",
                 t1,t2,s2,t3,t4);
-	sprintf(line,"n=%d",pfResults.samples);
         lcdWriteLine(3,line);
+        PROFILE_END(PROF_LCD, tl);
       }
-      pfStartMeasure();
     }
   }
 }
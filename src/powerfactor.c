@@ -1,217 +1,969 @@
 #include "board.h"
 
-// inputs:
-//  voltage via dividers 400k into 3k3 up and down + 470pF filter
-//    output 4.108mV/V; ADC full range (3v3) maps to 803.3v
-//      => voltage = 803.3 * adcval / 4096
-//  current from ADC758-50B 40mV/A
-//     full range maps to 82.5A
-//     => current = 82.5 * adcval / 4096
-//
-//  We use 'raw adc unit' as long as possible ;)
-//
-//
-
-#define USCALE (0.37)
-#define ISCALE (0.01)
-
-#define CYCLES 10
-#define CAL_CYCLES 500
-
-#define TIMEOUT_US 3000000
-#define CAL_TIMEOUT_US 5000000
-
-volatile int16_t  minU, minI, maxU, maxI;
-volatile int64_t  sumU2, sumI2;
-volatile int64_t  sumUI;
-volatile uint32_t measurementTime;
-volatile int32_t samples;
-volatile int16_t cycles;
+// default window length, 10 cycles at 50Hz and 12 at 60Hz (~200ms,
+// IEC 61000-4-30), see pfSetConfig() for others
+#define CYCLES_50HZ 10
+#define CYCLES_60HZ 12
+
+struct pfConfig pfConfig = { 0, 0, 0, PF_AVG_NONE };
+
+static uint16_t windowCycles = CYCLES_50HZ;               // of the running window
+static volatile uint16_t nextWindowCycles = CYCLES_50HZ;  // from the next boundary on
+static uint32_t pfMainsFrequency;                         // mHz, of the last window
+
+// Measurement windows are double buffered: the ISR integrates into the
+// active window and swaps at the window boundary, the main loop reads the
+// other one. Every sample after the first zero crossing lands in exactly
+// one window.
+struct pfWindow {
+  struct pfSums s;
+  int16_t  minU, minI, maxU, maxI;
+  int16_t  cycles;
+  bool     locked;      // sampling loop was locked at the end
+  uint32_t time;        // start, then length in us once complete
+  uint64_t cycleTime;   // sum of the timed cycles, ns
+  uint16_t timedCycles;
+  uint32_t cycle[PF_MAX_CYCLES];  // ns, the first PF_MAX_CYCLES timed cycles
+  bool     flagged;     // cut short by pfPause()
+  int64_t  cycleUI[2];  // U I of the cycles ended in the window, positive and negative
+  struct hrmSums h;
+};
+
+static struct pfWindow window[2];
+static struct pfWindow *acc = &window[0];
+static struct pfWindow pfAverage;     // windows since the last result
+static uint16_t pfAverageWindows;
+static uint32_t pfResultTime;         // millis() of the last result
+static volatile uint8_t  readyWindow;
+static volatile uint16_t windowSeq;   // completed windows
+static uint16_t lastSeq;              // last one read by pfWaitMeasure()
+uint16_t windowsLost;                 // windows completed but never read
 
 int16_t caloffset[2] = {0,0};
-int32_t calsum[2];
+
+struct pfCalibration pfCalibration = {
+  {0, 0}, USCALE_Q16, ISCALE_Q16, 0
+};
 
 #define MEASUREMENT_STARTED 1
 #define MEASUREMENT_RUNNING 2
-#define MEASUREMENT_VALID   4
-#define MEASUREMENT_ERROR   8
-#define MEASUREMENT_CALIBRATE 128
 
 volatile uint8_t measurementState;
-uint32_t __start;
 
 struct pfResults pfResults;
 
-#define ZC_THRESHOLD -200
-
+#define ZC_THRESHOLD (-(200 << ADC_RESOLUTION_SHIFT))
+
+// Mains synchronous sampling: the trigger timer is retuned on every
+// positive zero crossing so that one mains cycle is PLL_SAMPLES samples.
+// Periods are tracked in 1/256 sample units.
+#define PLL_GAIN_SHIFT 2   // loop gain 1/4
+#define PLL_LOCK_ERR   64  // 0.25 sample per cycle
+
+#ifndef ADC_FREERUN
+static bool     pllEnabled = true;
+#else
+static bool     pllEnabled = false;
+#endif
+static bool     pllArmed;
+static int16_t  pllLastU;
+static int32_t  pllCount;
+static uint32_t pllTicks; // sample period in 1/256 timer ticks
+volatile bool   pllLocked;
+
+// Crossings are timed against the trigger clock: every sample advances a
+// ps clock by the period the ADC driver reports for its block, so retunes
+// and dithering inside a cycle are accounted for exactly. The interpolated
+// crossing is placed between two samples with 1/256 sample resolution.
+static uint32_t pllSampleTime;  // ps, of the block being handled
+static uint64_t pllClock;       // ps
+static uint64_t pllCrossing;    // ps, time of the last crossing
+static bool     pllTimed;       // pllCrossing is valid
+static uint32_t pllCycleTime;   // ns of the cycle that just ended, 0 if unknown
+
+// Phase compensation between the voltage and current chains: the leading
+// channel is delayed by a fractional number of samples using linear
+// interpolation over a short history. Delays are in 1/256 samples.
+#define PHASE_HISTORY 8    // power of 2, longest delay just under 7 samples
+
+static int16_t  phaseDelay[2] = {0,0};
+static int16_t  phaseHistory[2][PHASE_HISTORY];
+static uint8_t  phasePos;
+
+// Background DC offset estimation: the mean of every whole mains cycle is
+// fed into an IIR that starts out as a running average and settles to a
+// time constant of 2^OFFSET_SHIFT cycles. Without zero crossings (no mains
+// voltage) the mean of OFFSET_MAX_SAMPLES samples is used instead.
+#define OFFSET_SHIFT       8
+#define OFFSET_MAX_SAMPLES 8192
+
+static int32_t  offsetSum[2];
+static uint16_t offsetSamples;
+static bool     offsetPrimed;
+static int32_t  offsetQ8[2];    // 1/256 sample units
+static uint16_t offsetCycles;
+
+// Quadrature reactive power: U delayed by a quarter of PLL_SAMPLES, i.e.
+// 90 degrees of the fundamental while the sampling loop is locked, times I.
+// Harmonic n is shifted by n x 90 degrees, as in a classic var meter.
+#define QUARTER_SAMPLES (PLL_SAMPLES / 4)
+
+static int16_t  quarterHistory[QUARTER_SAMPLES];
+static uint8_t  quarterPos;
+
+// Sums of each whole cycle for the sliding results, taken as differences
+// of the window sums at the crossings so the per sample work stays the
+// same. A cycle that straddles a window swap is carried over.
+static struct pfSums cycleMark;   // acc->s at the last crossing
+static struct pfSums cycleCarry;  // part of the cycle in the previous window
+static struct shapeSums cycleShape;
+static int16_t cycleDrift[2];     // offsets less the calibrated ones during the cycle
+
+// Urms(1/2) for the event detection, from half cycle sums taken the same
+// way. Half cycles end at the zero crossings in both directions, without
+// crossings (an interruption) they carry on every half period.
+static struct pfSums halfMark, halfCarry;
+static struct pfSums halfPrev;    // the half cycle before
+static uint16_t halfPos;          // samples since the last boundary
+static uint16_t halfSamples = PLL_SAMPLES / 2;
+static bool     halfArmed;        // U was positive, waiting for it to cross down
+static bool     halfFree;         // no crossings, counting half periods
+
+// Flash writes stall the CPU, and with it the ADC interrupt, for up to
+// ~20ms per erased page while the DMA ring keeps wrapping, so the blocks
+// handled meanwhile are not contiguous. pfPause() cuts the running window
+// short and flags it, blocks are dropped until pfResume() and measuring
+// starts over at the next positive crossing. The energy of the gap is
+// taken at the power of the last window.
+static volatile bool pfPaused;
+static bool     pfGap;            // energy of the gap still to be added
+static uint32_t pfGapStart;       // micros() at the pause
+static bool     pllGap;           // the next crossing only restarts the count
+
+
+void resetMeasurement(struct pfWindow *w)
+{
+  w->maxU = w->minU = w->maxI = w->minI = 0;
+  w->s.sumU2 = w->s.sumI2 = w->s.sumUI = w->s.sumUqI = 0;
+  w->s.samples = w->cycles = 0;
+  w->cycleTime = w->timedCycles = 0;
+  w->flagged = false;
+  w->cycleUI[0] = w->cycleUI[1] = 0;
+  hrmReset(&w->h);
+}
 
-void resetMeasurement()
+// U a quarter cycle ago, kept for every sample so it is contiguous when
+// a measurement starts
+static inline int16_t quarterDelay(int16_t u)
 {
-  maxU = minU = maxI = minI = 0;
-  sumU2 = sumI2 = sumUI = 0;
-  samples = cycles = 0;
+  int16_t uq = quarterHistory[quarterPos];
+
+  quarterHistory[quarterPos] = u;
+  quarterPos = (quarterPos + 1) & (QUARTER_SAMPLES - 1);
+  return uq;
 }
 
-void integrateMeasurement(int16_t u, int16_t i) // u in 0.1V, i in 1mA
+void integrateMeasurement(int16_t u, int16_t uq, int16_t i)
 {
-  if (u > maxU) {
-    maxU = u;
+  struct pfWindow *w = acc;
+
+  if (u > w->maxU) {
+    w->maxU = u;
   }
-  if (u < minU) {
-    minU = u;
+  if (u < w->minU) {
+    w->minU = u;
   }
-  if (i > maxI) {
-    maxI = i;
+  if (i > w->maxI) {
+    w->maxI = i;
   }
-  if (i < minI) {
-    minI = i;
+  if (i < w->minI) {
+    w->minI = i;
   }
-  sumU2 += (int64_t)u * (int64_t)u;
-  sumI2 += (int64_t)i * (int64_t)i;
-  sumUI = (int64_t)u * (int64_t)i;
+  w->s.sumU2 += (int64_t)u * (int64_t)u;
+  w->s.sumI2 += (int64_t)i * (int64_t)i;
+  w->s.sumUI += (int64_t)u * (int64_t)i;
+  w->s.sumUqI += (int64_t)uq * (int64_t)i;
+
+  w->s.samples++;
+
+  cycleShape.sumU += u;
+  cycleShape.sumI += i;
+  cycleShape.sumAbsU += abs(u);
+  cycleShape.sumAbsI += abs(i);
+  cycleShape.minU = min(cycleShape.minU, u);
+  cycleShape.maxU = max(cycleShape.maxU, u);
+  cycleShape.minI = min(cycleShape.minI, i);
+  cycleShape.maxI = max(cycleShape.maxI, i);
+}
 
-  samples++;
+// d += a - b
+static void pfSumsDelta(struct pfSums *d, const struct pfSums *a, const struct pfSums *b)
+{
+  d->sumU2 += a->sumU2 - b->sumU2;
+  d->sumI2 += a->sumI2 - b->sumI2;
+  d->sumUI += a->sumUI - b->sumUI;
+  d->sumUqI += a->sumUqI - b->sumUqI;
+  d->samples += a->samples - b->samples;
+}
 
+// the energy of a cycle goes one way by the sign of its net U I, so the
+// power of a load that both draws and feeds back within a window is not
+// netted out; a cycle that straddles windows counts in the one it ends in
+static void pfCycleEnergy(void)
+{
+  acc->cycleUI[cycleCarry.sumUI < 0] += cycleCarry.sumUI;
 }
 
-int detectZC(int16_t u)
+// the offsets move at crossings, keep the ones the cycle's samples had
+static void pfShapeStart(void)
 {
-  static bool zcstate = 0;
-  if (zcstate) {
-    if (u >= 0) {
-      zcstate = 0;
-      return 1;
-    }
+  shapeStart(&cycleShape);
+  cycleDrift[0] = caloffset[0] - pfCalibration.offset[0];
+  cycleDrift[1] = caloffset[1] - pfCalibration.offset[1];
+}
+
+static void pfCycleEnd(void)
+{
+  pfSumsDelta(&cycleCarry, &acc->s, &cycleMark);
+  pfCycleEnergy();
+  slideCycle(&cycleCarry, pllCycleTime);
+  shapeCycle(&cycleShape, &cycleCarry, cycleDrift);
+  pfShapeStart();
+  cycleMark = acc->s;
+  memset(&cycleCarry, 0, sizeof(cycleCarry));
+}
+
+static void pfHalfCycle(int16_t u, bool crossed)
+{
+  bool down = halfArmed && (u < 0);
+  bool boundary;
+  int64_t u2;
+  uint32_t n;
+
+  if (u > -ZC_THRESHOLD) {
+    halfArmed = true;
+  } else if (down) {
+    halfArmed = false;
+  }
+  halfPos++;
+  if (crossed || down) {
+    // a crossing just after a boundary would make a sliver of a half cycle
+    boundary = halfFree || (halfPos > halfSamples / 4);
+    halfFree = false;
+  } else {
+    // give a late crossing half a half period before counting on
+    boundary = halfPos >= (halfFree ? halfSamples : halfSamples + halfSamples / 2);
+    halfFree = halfFree || boundary;
+  }
+  if (!boundary) {
+    return;
+  }
+  halfPos = 0;
+  pfSumsDelta(&halfCarry, &acc->s, &halfMark);
+  halfMark = acc->s;
+
+  // one cycle, the last two half cycles
+  u2 = halfPrev.sumU2 + halfCarry.sumU2;
+  n = halfPrev.samples + halfCarry.samples;
+  if (halfPrev.samples && halfCarry.samples) {
+    evtHalfCycle((fixMulQ16(isqrt64(fixMean(u2, n, 16)), pfCalibration.uscale) + 128) >> 8);
+  }
+  inrHalfCycle(&halfCarry);
+  halfPrev = halfCarry;
+  memset(&halfCarry, 0, sizeof(halfCarry));
+}
+
+// mains frequency of a window in mHz as num / den, den 0 if unknown;
+// the ADC interrupt hands it on without dividing
+static void pfFrequencyRatio(const struct pfWindow *w, uint64_t *num, uint64_t *den)
+{
+  if (w->timedCycles) {
+    // mean of the cycles timed against the trigger clock
+    *num = 1000000000000ULL * w->timedCycles + w->cycleTime / 2;
+    *den = w->cycleTime;
+  } else if (adcGetSampleRate()) {
+    // timer triggered, the sample count is an exact timebase
+    *num = (uint64_t)adcGetSampleRate() * w->cycles * 1000;
+    *den = w->s.samples;
   } else {
+    *num = (uint64_t)w->cycles * 1000000000;
+    *den = w->time;
+  }
+}
+
+static uint32_t pfFrequency(const struct pfWindow *w)
+{
+  uint64_t num, den;
+
+  pfFrequencyRatio(w, &num, &den);
+  return den ? num / den : 0;
+}
+
+// half peak to peak in mV or uA
+static int32_t pfPeak(int16_t min, int16_t max, uint32_t scale)
+{
+  return fixMulQ16(max - min, scale) >> 1;
+}
+
+static void swapWindow()
+{
+  uint32_t now = micros();
+  acc->time = now - acc->time;
+  energyWindow(&acc->s, acc->cycleUI, &acc->h, acc->time);
+  acc->locked = pllLocked;
+  if (pllLocked && !acc->flagged) {
+    acc->cycles = windowCycles; // exact by construction
+  }
+  // every window, whether or not the main loop gets to read it
+  if (acc->s.samples) {
+    uint64_t num, den;
+    aggregateWindow(&acc->s, acc->time, acc->cycles, pfPeak(acc->minU, acc->maxU, pfCalibration.uscale),
+                    pfPeak(acc->minI, acc->maxI, pfCalibration.iscale), acc->flagged);
+    pfFrequencyRatio(acc, &num, &den);
+    histWindow(&acc->s, num, den);
+  }
+  windowCycles = nextWindowCycles;
+  pfSumsDelta(&cycleCarry, &acc->s, &cycleMark);
+  memset(&cycleMark, 0, sizeof(cycleMark));
+  pfSumsDelta(&halfCarry, &acc->s, &halfMark);
+  memset(&halfMark, 0, sizeof(halfMark));
+  readyWindow = (acc == &window[1]);
+  acc = &window[!readyWindow];
+  resetMeasurement(acc);
+  hrmRestart();
+  acc->time = now;
+  windowSeq++;
+}
+
+// tracks positive zero crossings, returns true at the end of each cycle
+bool pllUpdate(int16_t u)
+{
+  bool crossed = false;
+
+  pllCount += 256;
+  pllClock += pllSampleTime;
+  if (!pllArmed) {
     if (u < ZC_THRESHOLD) {
-      zcstate = 1;
+      pllArmed = true;
+    }
+  } else if (u >= 0) {
+    // interpolate the crossing between the previous (negative) and this sample
+    int32_t frac = ((int32_t)u << 8) / (u - pllLastU);
+    int32_t period = pllCount - frac;
+    int32_t err = period - (PLL_SAMPLES << 8);
+    uint64_t at = pllClock - (((uint64_t)frac * pllSampleTime) >> 8);
+    bool plausible = !pllGap && (period > (PLL_SAMPLES << 7)) && (period < (PLL_SAMPLES << 9));
+    pllArmed = false;
+    pllCount = frac;
+    crossed = true;
+
+    pllCycleTime = (pllTimed && plausible && pllSampleTime) ? (at - pllCrossing) / 1000 : 0;
+    pllCrossing = at;
+    pllTimed = true;
+    if (plausible) {
+      halfSamples = period >> 9;
+    }
+
+    if (!pllEnabled || pllGap) {
+      // crossing detection only, or the count ran over a pause
+      pllGap = false;
+    } else if (plausible) {
+      if (pllTicks != adcGetSamplePeriod()) {
+        // first run or the rate was changed behind our back
+        pllTicks = adcGetSamplePeriod();
+      }
+      pllTicks += ((int64_t)pllTicks * err / (PLL_SAMPLES << 8)) >> PLL_GAIN_SHIFT;
+      adcSetSamplePeriod(pllTicks);
+      pllTicks = adcGetSamplePeriod();
+      pllLocked = (abs(err) < PLL_LOCK_ERR);
+    } else {
+      // anything further than an octave away is noise or no mains
+      pllLocked = false;
+    }
+  }
+  pllLastU = u;
+  return crossed;
+}
+
+void pfSetSync(bool enable)
+{
+  if (enable == pllEnabled) {
+    return;
+  }
+  pllLocked = false;
+  pllArmed = false;
+  pllTicks = 0;
+  pllEnabled = enable && adcGetSamplePeriod();
+  if (!pllEnabled) {
+    adcSetSampleRate(ADC_SAMPLE_RATE);
+  }
+}
+
+// correction in 0.01 degrees at the nominal PLL_SAMPLES per cycle,
+// positive when the current chain lags (U gets delayed), negative delays I;
+// limited to PF_MAX_PHASE
+void pfSetPhaseCorrection(int16_t centidegrees)
+{
+  int32_t d;
+
+  centidegrees = constrain(centidegrees, -PF_MAX_PHASE, PF_MAX_PHASE);
+  d = ((int32_t)abs(centidegrees) * PLL_SAMPLES * 256) / 36000;
+  pfCalibration.phase = centidegrees;
+  phaseDelay[0] = (centidegrees > 0) ? d : 0;
+  phaseDelay[1] = (centidegrees < 0) ? d : 0;
+}
+
+static inline int16_t phaseDelaySample(uint8_t ch, int16_t x)
+{
+  int16_t d = phaseDelay[ch];
+  int16_t a, b;
+
+  phaseHistory[ch][phasePos] = x;
+  if (!d) {
+    return x;
+  }
+  a = phaseHistory[ch][(phasePos - (d >> 8)) & (PHASE_HISTORY - 1)];
+  b = phaseHistory[ch][(phasePos - (d >> 8) - 1) & (PHASE_HISTORY - 1)];
+  return a + (((int32_t)(b - a) * (d & 0xff)) >> 8);
+}
+
+static void offsetUpdate(int16_t values[2], bool cycle)
+{
+  uint8_t ch;
+
+  offsetSum[0] += values[0];
+  offsetSum[1] += values[1];
+  offsetSamples++;
+  if (!cycle && (offsetSamples < OFFSET_MAX_SAMPLES)) {
+    return;
+  }
+
+  // the samples before the first crossing are not a whole cycle
+  if (offsetPrimed || !cycle) {
+    if (offsetCycles < (1 << OFFSET_SHIFT)) {
+      offsetCycles++;
+    }
+    for (ch = 0; ch < 2; ch++) {
+      int32_t mean = (int64_t)offsetSum[ch] * 256 / offsetSamples;
+      offsetQ8[ch] += (mean - offsetQ8[ch]) / offsetCycles;
+      caloffset[ch] = (offsetQ8[ch] + 128) >> 8;
     }
   }
-  return 0;
+  offsetPrimed = true;
+  offsetSum[0] = offsetSum[1] = 0;
+  offsetSamples = 0;
+}
+
+void pfOffsetReset()
+{
+  __disable_irq();
+  offsetPrimed = false;
+  offsetCycles = 0;
+  offsetSum[0] = offsetSum[1] = 0;
+  offsetSamples = 0;
+  __enable_irq();
+}
+
+// seed the offset estimate with a known value, tracking continues from there
+static void offsetSeed(int16_t offset[2])
+{
+  uint8_t ch;
+  __disable_irq();
+  for (ch = 0; ch < 2; ch++) {
+    offsetQ8[ch] = (int32_t)offset[ch] * 256;
+    caloffset[ch] = offset[ch];
+  }
+  offsetCycles = 1 << OFFSET_SHIFT;
+  offsetPrimed = false;
+  offsetSum[0] = offsetSum[1] = 0;
+  offsetSamples = 0;
+  __enable_irq();
+}
+
+// convergence of the offset estimate in percent, 100 once fully settled
+uint8_t pfOffsetState()
+{
+  return ((uint32_t)offsetCycles * 100) >> OFFSET_SHIFT;
 }
 
 volatile int16_t lastu,lasti;
 volatile int16_t lastuc,lastic;
 
-void handleValuesFromADC(int16_t values[2]) // values are U, I
+// a sample less its offset, a clipped sample stays at the rail it hit
+static inline int16_t offsetRemove(int16_t x, int16_t offset)
+{
+  int32_t v = (int32_t)x - offset;
+  return constrain(v, INT16_MIN, INT16_MAX);
+}
+
+void handleValuesFromADC(int16_t values[2]) // values are U, I, signed around mid scale
 {
-  values[0]-=2048;
-  values[1]-=2048;
   lastu=values[0];
   lasti=values[1];
-  int16_t _u = values[0] - caloffset[0];
-  int16_t _i = values[1] - caloffset[1];
+  int16_t _u = phaseDelaySample(0, offsetRemove(values[0], caloffset[0]));
+  int16_t _i = phaseDelaySample(1, offsetRemove(values[1], caloffset[1]));
+  int16_t _uq = quarterDelay(_u);
+  phasePos = (phasePos + 1) & (PHASE_HISTORY - 1);
   lastuc=_u;
   lastic=_i;
 
-  if (measurementState & MEASUREMENT_CALIBRATE) {
-      calsum[0] += values[0];
-      calsum[1] += values[1];
-      samples++;
-      if ((micros() - measurementTime) >= CAL_TIMEOUT_US) {
-        caloffset[0] = calsum[0] / samples;
-        caloffset[1] = calsum[1] / samples;
-        measurementState = 0;
-      }
-    return;
-  }
+  bool crossed = pllUpdate(_u);
+  offsetUpdate(values, crossed);
+  fftSample(_u, _i, crossed);
+  recSample(_u, _i);
 
   if (!(measurementState & MEASUREMENT_STARTED)) {
     return;
   }
 
-  //  if ((micros() - measurementTime) > TIMEOUT_US) {
-  //    measurementTime = micros() - measurementTime;
-  //    measurementState = MEASUREMENT_ERROR;
-  //   return;
-  //}
-
   if (!(measurementState & MEASUREMENT_RUNNING)) {
     // wait until it crosses positive and go into measurement mode
-    if (detectZC(_u)) {
-      measurementTime = micros();
-      measurementState |= MEASUREMENT_RUNNING;
+    if (!crossed) {
+      return;
     }
+    acc->time = micros();
+    if (pfGap) {
+      // the last window is the one cut short, if it had any samples
+      energyWindow(&window[readyWindow].s, window[readyWindow].cycleUI, &window[readyWindow].h,
+                   acc->time - pfGapStart);
+      pfGap = false;
+    }
+    hrmRestart();
+    memset(&cycleMark, 0, sizeof(cycleMark));
+    memset(&cycleCarry, 0, sizeof(cycleCarry));
+    pfShapeStart();
+    memset(&halfMark, 0, sizeof(halfMark));
+    memset(&halfCarry, 0, sizeof(halfCarry));
+    memset(&halfPrev, 0, sizeof(halfPrev));
+    halfPos = 0;
+    measurementState |= MEASUREMENT_RUNNING;
+  } else {
+    if (crossed) {
+      pfCycleEnd();
+      acc->cycles++;
+      if (pllCycleTime) {
+        acc->cycleTime += pllCycleTime;
+        if (acc->timedCycles < PF_MAX_CYCLES) {
+          acc->cycle[acc->timedCycles] = pllCycleTime;
+        }
+        acc->timedCycles++;
+      }
+    }
+    pfHalfCycle(_u, crossed);
+    inrSample(_i);
+    flkSample(_u);
+    // when locked the window is an exact number of samples, no edge error
+    if (pllLocked ? (acc->s.samples >= windowCycles * PLL_SAMPLES) : (acc->cycles >= windowCycles)) {
+      swapWindow();
+    }
+  }
+
+  PROFILE_START(t);
+  integrateMeasurement(_u, _uq, _i);
+  PROFILE_END(PROF_INTEGRATE, t);
+
+  PROFILE_START(th);
+  hrmSample(&acc->h, _u, _i);
+  PROFILE_END(PROF_HARMONICS, th);
+}
+
+void handleBlockFromADC(volatile uint32_t *block, uint16_t count) // packed U | I<<16
+{
+  int16_t values[2];
+  if (pfPaused) {
+    return;
+  }
+  pllSampleTime = adcGetSampleTime();
+  while (count--) {
+    uint32_t v = *(block++);
+    values[0] = (int32_t)(v & 0xffff) - 0x8000;
+    values[1] = (int32_t)(v >> 16) - 0x8000;
+    PROFILE_START(t);
+    handleValuesFromADC(values);
+    PROFILE_END(PROF_ADC_SAMPLE, t);
   }
+}
 
+// (re)start continuous measurement, the first window begins at the next
+// positive zero crossing
+void pfStartMeasure()
+{
+  __disable_irq();
+  measurementState = 0;
+  hrmInit();
+  resetMeasurement(&window[0]);
+  resetMeasurement(&window[1]);
+  acc = &window[0];
+  windowCycles = nextWindowCycles;
+  lastSeq = windowSeq;
+  pfAverageWindows = 0;
+  slideReset();
+  measurementState = MEASUREMENT_STARTED;
+  __enable_irq();
+}
+
+void pfPause(void)
+{
+  __disable_irq();
   if (measurementState & MEASUREMENT_RUNNING) {
-    if (detectZC(_u)) {
-      cycles++;
+    if (!pfGap) {
+      pfGapStart = micros();
+      pfGap = true;
     }
+    // the cycle cut short counts by its own sign
+    pfSumsDelta(&cycleCarry, &acc->s, &cycleMark);
+    cycleMark = acc->s;
+    pfCycleEnergy();
+    acc->flagged = true;
+    swapWindow();
+  }
+  pfPaused = true;
+  __enable_irq();
+}
 
-    if (cycles >= CYCLES) {
-      measurementState = MEASUREMENT_VALID;
-      measurementTime = micros() - measurementTime;
-      return;
-    }
+// the first crossing after the pause restarts the measurement, the cycle
+// timing and the offset sums; the sampling loop keeps its period
+void pfResume(void)
+{
+  __disable_irq();
+  pfPaused = false;
+  pllArmed = false;
+  pllTimed = false;
+  pllGap = true;
+  offsetPrimed = false;
+  offsetSum[0] = offsetSum[1] = 0;
+  offsetSamples = 0;
+  if (measurementState) {
+    measurementState = MEASUREMENT_STARTED;
+  }
+  flkResync();
+  __enable_irq();
+}
+
+// sample units squared to nW, with the same fraction bits; the scales are
+// applied one after the other, their product does not fit 32 bits once the
+// gains go up by ~4.5x from the defaults
+int64_t pfPowerScale(int64_t x)
+{
+  return fixMulQ16(fixMulQ16(x, pfCalibration.uscale), pfCalibration.iscale);
+}
+
+// nW Q8 to mW, rounded
+static int32_t pfMilli(int64_t nw)
+{
+  return (nw + ((nw < 0) ? -128000000 : 128000000)) / 256000000;
+}
+
+// power of two RMS values in 1/256 sample units, nW Q8
+static int64_t pfProduct(uint32_t u, uint32_t i)
+{
+  return pfPowerScale((uint64_t)u * i) >> 8;
+}
 
-    integrateMeasurement(_u, _i);
+static int16_t pfRatio(int64_t p, int64_t s)
+{
+  return s ? ((p * 1000 + ((p < 0) ? -s : s) / 2) / s) : 0;
+}
+
+// RMS values in 1/256 sample units, power in nW Q8
+void pfSumsToPower(const struct pfSums *s, struct pfPower *p)
+{
+  uint32_t u = isqrt64(fixMean(s->sumU2, s->samples, 16));
+  uint32_t i = isqrt64(fixMean(s->sumI2, s->samples, 16));
+  int64_t  w = pfPowerScale(fixMean(s->sumUI, s->samples, 8));
+  int64_t  q = pfPowerScale(fixMean(s->sumUqI, s->samples, 8));
+  int64_t  va = pfProduct(u, i);
+
+  p->Urms = (fixMulQ16(u, pfCalibration.uscale) + 128) >> 8;
+  p->Irms = (fixMulQ16(i, pfCalibration.iscale) + 128) >> 8;
+  p->powerW = pfMilli(w);
+  p->powerVAR = pfMilli(q);
+  p->powerVA = pfMilli(va);
+  p->powerFactor = pfRatio(w, va);
+}
+
+// Fundamental and non-fundamental parts of the window. Squares stay in
+// sample units (Q16) until the end, the harmonic content is the
+// difference of two large numbers. With blocks of PLL_SAMPLES^2 = 2^16, a
+// bin of RMS X has |sum|^2 = X^2 blocks^2 PLL_SAMPLES^2 / 2.
+static void pfDecompose(const struct pfSums *s, const struct hrmSums *h, struct pfResults *r)
+{
+  struct pfIEEE1459 *e = &r->ieee;
+  uint64_t sq[2], sq1[2];
+  uint32_t x1[2], xh[2];
+  int64_t  s1, di, dv, sh;
+  uint8_t  ch;
+
+  memset(e, 0, sizeof(*e));
+  if (!h->blocks || !s->samples) {
+    return;
+  }
+  sq[0] = fixMean(s->sumU2, s->samples, 16);
+  sq[1] = fixMean(s->sumI2, s->samples, 16);
+  for (ch = 0; ch < 2; ch++) {
+    int64_t re = h->re[ch][0], im = h->im[ch][0];
+    sq1[ch] = (uint64_t)(re * re + im * im) * 2 / ((uint32_t)h->blocks * h->blocks);
+    x1[ch] = isqrt64(sq1[ch]);
+    xh[ch] = isqrt64((sq[ch] > sq1[ch]) ? (sq[ch] - sq1[ch]) : 0);
+  }
+
+  e->U1 = (fixMulQ16(x1[0], pfCalibration.uscale) + 128) >> 8;
+  e->I1 = (fixMulQ16(x1[1], pfCalibration.iscale) + 128) >> 8;
+  e->UH = (fixMulQ16(xh[0], pfCalibration.uscale) + 128) >> 8;
+  e->IH = (fixMulQ16(xh[1], pfCalibration.iscale) + 128) >> 8;
+
+  // U I* per block is U1 I1 PLL_SAMPLES^2 / 2 e^j(phi)
+  e->P1 = pfMilli(pfPowerScale(fixMean(h->p1 * 2, (uint32_t)h->blocks * PLL_SAMPLES * PLL_SAMPLES, 8)));
+  e->Q1 = pfMilli(pfPowerScale(fixMean(h->q1 * 2, (uint32_t)h->blocks * PLL_SAMPLES * PLL_SAMPLES, 8)));
+
+  s1 = pfProduct(x1[0], x1[1]);
+  di = pfProduct(x1[0], xh[1]);
+  dv = pfProduct(xh[0], x1[1]);
+  sh = pfProduct(xh[0], xh[1]);
+  e->S1 = pfMilli(s1);
+  e->DI = pfMilli(di);
+  e->DV = pfMilli(dv);
+  e->SH = pfMilli(sh);
+  e->SN = isqrt64((int64_t)e->DI * e->DI + (int64_t)e->DV * e->DV + (int64_t)e->SH * e->SH);
+  e->pf1 = pfRatio(e->P1, e->S1);
+
+  {
+    int64_t s2 = (int64_t)r->power.powerVA * r->power.powerVA;
+    int64_t n2 = s2 - (int64_t)r->power.powerW * r->power.powerW;
+    int64_t d2 = n2 - (int64_t)e->Q1 * e->Q1;
+    e->N = isqrt64((n2 > 0) ? n2 : 0);
+    e->D = isqrt64((d2 > 0) ? d2 : 0);
   }
 }
 
-void pfCalibrateStart()
+void pfPowerReport(void)
 {
-  caloffset[0] = 0;
-  caloffset[1] = 0;
-  calsum[0] = 0;
-  calsum[1] = 0;
-  samples = 0;
-  measurementTime = micros();
-  measurementState = MEASUREMENT_CALIBRATE;
+  struct pfPower *p = &pfResults.power;
+  struct pfIEEE1459 *e = &pfResults.ieee;
+
+  printf("U %d mV I %d uA P %d mW Q %d mvar S %d mVA pf %d\n",
+         p->Urms, p->Irms, p->powerW, p->powerVAR, p->powerVA, p->powerFactor);
+  printf("U1 %d UH %d mV I1 %d IH %d uA\n", e->U1, e->UH, e->I1, e->IH);
+  printf("P1 %d mW Q1 %d mvar S1 %d mVA pf1 %d\n", e->P1, e->Q1, e->S1, e->pf1);
+  printf("SN %d DI %d DV %d SH %d mVA N %d D %d mvar\n", e->SN, e->DI, e->DV, e->SH, e->N, e->D);
 }
 
-uint8_t pfCalibrating()
+// frequency of every cycle of the last window, mHz
+void pfCycleReport(void)
 {
-  if (measurementState & MEASUREMENT_CALIBRATE) {
-    uint32_t spent = micros() - measurementTime;
-    uint8_t out = (100 * spent) / CAL_TIMEOUT_US;
-    if (!out) {
-      out = 1;
-    }
-    return out;
-  } else {
-    return 0;
+  uint8_t n;
+
+  printf("f %u mHz, %d cycles timed\n", pfResults.frequency, pfResults.timedCycles);
+  for (n = 0; n < pfResults.timedCycles; n++) {
+    printf("%d %u\n", n, pfResults.cycleFrequency[n]);
   }
 }
 
-void pfStartMeasure()
+#ifdef FLOAT_DEBUG
+struct pfFloat pfFloat;
+
+// the float results the integer path replaced, same window
+static void pfFloatWindow(const struct pfSums *s, uint16_t cycles)
+{
+  float uscale = pfCalibration.uscale / 65536000.0f;      // V
+  float iscale = pfCalibration.iscale / 65536000000.0f;   // A
+
+  pfFloat.Urms = sqrtf((float)s->sumU2 / (float)s->samples) * uscale;
+  pfFloat.Irms = sqrtf((float)s->sumI2 / (float)s->samples) * iscale;
+  pfFloat.powerW = (float)s->sumUI / (float)s->samples * uscale * iscale;
+  pfFloat.powerVA = pfFloat.Urms * pfFloat.Irms;
+  pfFloat.powerFactor = pfFloat.powerW / pfFloat.powerVA;
+  pfFloat.frequency = (float)adcGetSampleRate() * (float)cycles / (float)s->samples;
+}
+
+void pfFloatReport(void)
 {
-  // return non zero if in trouble
-  measurementTime = micros();
-  resetMeasurement();
-  measurementState = MEASUREMENT_STARTED; // clears other bits
+  printf("int   %d mV %d uA %d mW %d mVA pf %d mHz %u\n",
+         pfResults.power.Urms, pfResults.power.Irms, pfResults.power.powerW,
+         pfResults.power.powerVA, pfResults.power.powerFactor, pfResults.frequency);
+  printf("float %d mV %d uA %d mW %d mVA pf %d mHz %d\n",
+         (int32_t)(pfFloat.Urms * 1000), (int32_t)(pfFloat.Irms * 1000000),
+         (int32_t)(pfFloat.powerW * 1000), (int32_t)(pfFloat.powerVA * 1000),
+         (int32_t)(pfFloat.powerFactor * 1000), (int32_t)(pfFloat.frequency * 1000));
 }
+#endif
+
+// window length in cycles for the configuration at the given mains frequency
+static uint16_t pfWindowCycles(uint32_t frequency)
+{
+  uint32_t n;
 
+  if (pfConfig.cycles) {
+    return pfConfig.cycles;
+  }
+  if (!pfConfig.ms) {
+    return (frequency > 55000) ? CYCLES_60HZ : CYCLES_50HZ;
+  }
+  // nominal 50Hz until the mains has been measured
+  n = ((uint64_t)pfConfig.ms * (frequency ? frequency : 50000) + 500000) / 1000000;
+  return constrain(n, 1, PF_MAX_WINDOW_CYCLES);
+}
+
+// add window b to a, as if a had run on for the length of b
+static void pfMergeWindow(struct pfWindow *a, const struct pfWindow *b)
+{
+  uint8_t n;
+
+  a->s.sumU2 += b->s.sumU2;
+  a->s.sumI2 += b->s.sumI2;
+  a->s.sumUI += b->s.sumUI;
+  a->s.sumUqI += b->s.sumUqI;
+  a->s.samples += b->s.samples;
+  a->minU = min(a->minU, b->minU);
+  a->minI = min(a->minI, b->minI);
+  a->maxU = max(a->maxU, b->maxU);
+  a->maxI = max(a->maxI, b->maxI);
+  a->cycles += b->cycles;
+  a->locked = a->locked && b->locked;
+  a->time += b->time;
+  a->cycleTime += b->cycleTime;
+  for (n = 0; (n < b->timedCycles) && (a->timedCycles + n < PF_MAX_CYCLES); n++) {
+    a->cycle[a->timedCycles + n] = b->cycle[n];
+  }
+  a->timedCycles += b->timedCycles;
+  a->flagged = a->flagged || b->flagged;
+  hrmMerge(&a->h, &b->h);
+}
+
+// all results of a window (or of merged windows) into pfResults
+static void pfPublish(const struct pfWindow *w)
+{
+  uint8_t n;
+
+  pfResults.frequency = pfFrequency(w);
+  pfResults.Upp = pfPeak(w->minU, w->maxU, pfCalibration.uscale);
+  pfResults.Ipp = pfPeak(w->minI, w->maxI, pfCalibration.iscale);
+
+  pfSumsToPower(&w->s, &pfResults.power);
+#ifdef FLOAT_DEBUG
+  pfFloatWindow(&w->s, w->cycles);
+#endif
+  hrmCompute(&w->h, w->locked);
+  pfDecompose(&w->s, &w->h, &pfResults);
+
+  pfResults.samples = w->s.samples;
+  pfResults.cycles = w->cycles;
+  pfResults.timedCycles = min(w->timedCycles, PF_MAX_CYCLES);
+  for (n = 0; n < pfResults.timedCycles; n++) {
+    pfResults.cycleFrequency[n] = (1000000000000ULL + w->cycle[n] / 2) / w->cycle[n];
+  }
+  pfResults.time = w->time;
+  pfResults.flagged = w->flagged;
+  pfResultTime = millis();
+  pfAverageWindows = 0;
+}
+
+// Returns 1 when new results are in pfResults, 0 otherwise. Results are
+// published once per refresh interval from the last window or from all
+// windows since the last result. The aggregation and the histograms are
+// fed from swapWindow().
 uint8_t pfWaitMeasure()
 {
-  if (measurementState & MEASUREMENT_STARTED) {
+  struct pfWindow w;
+  uint16_t seq;
+  uint32_t frequency;
+
+  if (windowSeq == lastSeq) {
     return 0; // still running
   }
 
-  if (measurementState & MEASUREMENT_ERROR) {
-    return 3; // error from the interrupt routine, likely timeout
+  // the ready window stays untouched until the next swap, copy it out
+  __disable_irq();
+  w = window[readyWindow];
+  seq = windowSeq;
+  __enable_irq();
+  windowsLost += seq - lastSeq - 1;
+  lastSeq = seq;
+
+  if (!w.s.samples) {
+    return 2;
   }
 
-  if (measurementState & MEASUREMENT_VALID) {
-    pfResults.frequency = 1000000.0 * (float) CYCLES / (float)measurementTime;
+  // follow the mains, takes effect at the next window boundary
+  frequency = pfFrequency(&w);
+  pfMainsFrequency = frequency;
+  nextWindowCycles = pfWindowCycles(frequency);
+
+  if (!pfAverageWindows || (pfConfig.averaging == PF_AVG_NONE)) {
+    pfAverage = w;
+  } else if (pfAverage.h.blocks + w.h.blocks > HRM_MAX_BLOCKS) {
+    // the harmonic sums are full, publish what there is and start over
+    pfPublish(&pfAverage);
+    pfAverage = w;
+    pfAverageWindows = 1;
+    return 1;
+  } else {
+    pfMergeWindow(&pfAverage, &w);
+  }
+  pfAverageWindows++;
 
-    pfResults.Upp = (float)(maxU - minU) * USCALE * 0.5;
-    pfResults.Ipp = (float)(maxI - minI) * ISCALE * 0.5 ;
+  if (pfConfig.refresh && ((millis() - pfResultTime) < pfConfig.refresh)) {
+    return 0;
+  }
+  pfPublish(&pfAverage);
+  return 1;
+}
 
-    pfResults.Urms = sqrtf((float)sumU2 / (float)samples) * USCALE;
-    pfResults.Irms = sqrtf((float)sumI2 / (float)samples) * ISCALE;
+// Window length, refresh and averaging; the running window completes with
+// the old length, the new one starts at the next window boundary.
+void pfSetConfig(const struct pfConfig *c)
+{
+  pfConfig.cycles = min(c->cycles, PF_MAX_WINDOW_CYCLES);
+  pfConfig.ms = min(c->ms, PF_MAX_WINDOW_MS);
+  pfConfig.refresh = min(c->refresh, PF_MAX_REFRESH_MS);
+  pfConfig.averaging = (c->averaging < PF_AVG_MODES) ? c->averaging : PF_AVG_NONE;
+  nextWindowCycles = pfWindowCycles(pfMainsFrequency);
+  pfAverageWindows = 0;
+}
 
-    pfResults.powerW  = pfResults.Urms * pfResults.Irms;
-    pfResults.powerVA = (float)sumUI / (float)samples * USCALE * ISCALE;
-    pfResults.powerFactor = pfResults.powerVA / pfResults.powerW;
+void pfConfigReport(void)
+{
+  static const char *avg[PF_AVG_MODES] = { "none", "block" };
 
-    pfResults.samples = samples;
-    pfResults.time = measurementTime;
-    measurementState = 0;
-    return 1;
+  printf("window %d cycles (%d set, %d ms set) refresh %d ms averaging %s\n",
+         nextWindowCycles, pfConfig.cycles, pfConfig.ms, pfConfig.refresh, avg[pfConfig.averaging]);
+}
+
+// Rescales the gains so that the last result reads the reference values,
+// in mV and uA; 0 leaves a channel as it is. Returns false when there is
+// no reading of that channel to go by.
+bool pfCalibrateGain(uint32_t mV, uint32_t uA)
+{
+  int32_t u = pfResults.power.Urms, i = pfResults.power.Irms;
+
+  if ((mV && (u <= 0)) || (uA && (i <= 0))) {
+    return false;
   }
+  if (mV) {
+    pfCalibration.uscale = constrain(((uint64_t)pfCalibration.uscale * mV + u / 2) / u, 1, UINT32_MAX);
+  }
+  if (uA) {
+    pfCalibration.iscale = constrain(((uint64_t)pfCalibration.iscale * uA + i / 2) / i, 1, UINT32_MAX);
+  }
+  return true;
+}
 
-  return 2; // other error;
+void pfCalibrationReport(void)
+{
+  printf("offset U %d I %d uscale %u iscale %u phase %d\n", pfCalibration.offset[0],
+         pfCalibration.offset[1], pfCalibration.uscale, pfCalibration.iscale, pfCalibration.phase);
 }
 
+// take the current offset estimate into pfCalibration, ready to be saved
+void pfCaptureCalibration()
+{
+  pfCalibration.offset[0] = caloffset[0];
+  pfCalibration.offset[1] = caloffset[1];
+}
 
+// make pfCalibration (e.g. loaded from flash) effective
+void pfApplyCalibration()
+{
+  offsetSeed(pfCalibration.offset);
+  pfSetPhaseCorrection(pfCalibration.phase);
+}
@@ -1,16 +1,143 @@
 #include "board.h"
 
-void handleValuesFromADC(int16_t[4]);
-void pfCalibrateStart();
-uint8_t pfCalibrating();
+// inputs:
+//  voltage via dividers 400k into 3k3 up and down + 470pF filter
+//    output 4.108mV/V; ADC full range (3v3) maps to 803.3v
+//      => voltage = 803.3 * adcval / 4096
+//  current from ADC758-50B 40mV/A
+//     full range maps to 82.5A
+//     => current = 82.5 * adcval / 4096
+//
+//  We use 'raw adc unit' as long as possible ;)
+//
+//  Samples arrive as signed 16 bit (12 bit ADC scaled up by
+//  ADC_RESOLUTION_SHIFT, or oversampled), scales are per 16 bit unit.
+
+#define USCALE (0.37 / (1 << ADC_RESOLUTION_SHIFT))
+#define ISCALE (0.01 / (1 << ADC_RESOLUTION_SHIFT))
+
+// the same as Q16 integers, folded at compile time:
+// mV and uA per sample unit
+#define USCALE_Q16 ((uint32_t)(USCALE * 1000.0 * 65536.0 + 0.5))
+#define ISCALE_Q16 ((uint32_t)(ISCALE * 1000000.0 * 65536.0 + 0.5))
+
+// samples per mains cycle while the sampling loop is locked
+#define PLL_SAMPLES 256
+
+// per cycle frequencies kept for each window, covers 12 cycles at 60Hz
+#define PF_MAX_CYCLES 16
+
+// longest phase correction in 0.01 degrees, just under the phase
+// history of 7 samples at PLL_SAMPLES per cycle
+#define PF_MAX_PHASE 980
+
+// measurement window setup, see pfSetConfig()
+#define PF_MAX_WINDOW_CYCLES 256      // within HRM_MAX_BLOCKS
+#define PF_MAX_WINDOW_MS     5000
+#define PF_MAX_REFRESH_MS    60000
+
+enum {
+  PF_AVG_NONE = 0,      // a result is the last window before the refresh
+  PF_AVG_BLOCK,         // a result covers all windows since the previous one
+  PF_AVG_MODES
+};
+
+struct pfConfig {
+  uint16_t cycles;      // window length in mains cycles, 0 to use ms
+  uint16_t ms;          // window length in ms, 0 for 10/12 cycles
+  uint16_t refresh;     // ms between results, 0 for every window
+  uint8_t  averaging;   // PF_AVG_*
+};
+
+extern struct pfConfig pfConfig;
+
+// raw sums of a measurement interval, in sample units
+struct pfSums {
+  int64_t  sumU2, sumI2;
+  int64_t  sumUI;
+  int64_t  sumUqI;      // U delayed by a quarter cycle, times I
+  uint32_t samples;
+};
+
+// results are integers, see fixmath.h
+struct pfPower {
+  int32_t Urms, Irms;           // mV, uA
+  int32_t powerW, powerVA;      // mW, mVA
+  int32_t powerVAR;             // quadrature reactive power, mvar
+  int16_t powerFactor;          // 0.001
+};
+
+// IEEE 1459 decomposition of a window, the fundamental comes from the
+// harmonic bank; mV, uA, mW, mvar and mVA
+struct pfIEEE1459 {
+  int32_t U1, I1, UH, IH;       // fundamental and non-fundamental RMS
+  int32_t P1, Q1, S1;           // fundamental powers
+  int32_t SN;                   // non-fundamental apparent power
+  int32_t DI, DV, SH;           // current and voltage distortion, harmonic apparent
+  int32_t N;                    // non-active power, sqrt(S^2 - P^2)
+  int32_t D;                    // distortion power, sqrt(S^2 - P^2 - Q1^2)
+  int16_t pf1;                  // displacement power factor P1 / S1, 0.001
+};
+
+void handleValuesFromADC(int16_t[2]);
+void handleBlockFromADC(volatile uint32_t *, uint16_t);
+void pfOffsetReset();
+uint8_t pfOffsetState();
 void pfStartMeasure();
 uint8_t pfWaitMeasure();
+void pfPause(void);
+void pfResume(void);
+void pfSetSync(bool enable);
+void pfSetPhaseCorrection(int16_t centidegrees);
+void pfSetConfig(const struct pfConfig *c);
+void pfConfigReport(void);
+void pfCaptureCalibration();
+void pfApplyCalibration();
+bool pfCalibrateGain(uint32_t mV, uint32_t uA);
+void pfCalibrationReport(void);
+
+extern volatile bool pllLocked;
+extern uint16_t windowsLost;
 
 struct pfResults {
-  float Upp, Ipp, Urms, Irms;
-  float powerW, powerVA, powerFactor;
-  float frequency;
+  int32_t Upp, Ipp;             // half peak to peak, mV and uA
+  struct pfPower power;
+  struct pfIEEE1459 ieee;
+  uint32_t frequency;           // mHz
   uint32_t samples,time;
+  uint16_t cycles;
+  bool     flagged;             // cut short for a flash write, see pfPause()
+  uint8_t  timedCycles;         // cycles in cycleFrequency[]
+  uint32_t cycleFrequency[PF_MAX_CYCLES];   // mHz, each cycle of the window
 };
 
 extern struct pfResults pfResults;
+
+void pfSumsToPower(const struct pfSums *s, struct pfPower *p);
+int64_t pfPowerScale(int64_t x);
+void pfPowerReport(void);
+void pfCycleReport(void);
+
+// calibration constants, persisted in flash by main
+#define PF_CALIBRATION_VERSION 2
+
+struct pfCalibration {
+  int16_t  offset[2];       // ADC offsets, 16 bit sample units
+  uint32_t uscale, iscale;  // mV and uA per sample unit, Q16
+  int16_t  phase;           // 0.01 degree, see pfSetPhaseCorrection()
+};
+
+extern struct pfCalibration pfCalibration;
+
+#ifdef FLOAT_DEBUG
+// the same window computed in float, to check the integer path against
+struct pfFloat {
+  float Urms, Irms;
+  float powerW, powerVA, powerFactor;
+  float frequency;
+};
+
+extern struct pfFloat pfFloat;
+
+void pfFloatReport(void);
+#endif
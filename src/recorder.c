@@ -0,0 +1,208 @@
+#include "board.h"
+
+/*
+    Samples are stored packed as in the ADC DMA ring, U in the low and I
+    in the high halfword, after offset and phase correction. The trigger
+    is checked on the stored samples only; it fires once the pre trigger
+    part of the ring is full, the sample it fires on is number recInfo.pre
+    of the snapshot.
+
+    recDump() sends the snapshot as binary, all fields little endian:
+
+      'W' 'F' version cause
+      uint16 samples, uint16 pre
+      uint32 ps between samples
+      uint32 uscale, iscale         Q16 mV and uA per sample unit
+      uint32 millis() at the trigger
+      samples x (int16 U, int16 I)
+      uint16 Fletcher-16 of everything after the magic
+
+    4122 bytes for the full ring, 0.36s at 115200 baud.
+*/
+
+#define REC_VERSION 1
+
+struct recConfig recConfig = { REC_TRIG_MANUAL, REC_EITHER, 0, 25, 1 };
+struct recInfo recInfo;
+
+// the FFT buffer while it is claimed, int32 data read as uint32
+static uint32_t *const recRing = (uint32_t *)fftData;
+static volatile uint8_t recStatus;
+static uint16_t recPos;         // next to write, the oldest once full
+static uint16_t recFill;
+static uint16_t recPre;         // samples before the trigger
+static uint16_t recRemain;      // post trigger samples still to store
+static uint8_t  recSkip;
+static int16_t  recLevel;       // sample units
+static int16_t  recPrev;
+
+// level in mV or uA to sample units, clamped to the 16 bit range
+static int16_t recUnits(int32_t level, uint32_t scale)
+{
+  int64_t x = (int64_t)level * 65536 / scale;
+  return constrain(x, -32768, 32767);
+}
+
+bool recArm(const struct recConfig *c)
+{
+  if ((recStatus == REC_OFF) && !fftClaim()) {
+    return false;
+  }
+  __disable_irq();
+  recConfig = *c;
+  recConfig.trigger = (c->trigger < REC_TRIGGERS) ? c->trigger : REC_TRIG_MANUAL;
+  recConfig.pre = min(c->pre, 100);
+  recConfig.divider = constrain(c->divider, 1, REC_MAX_DIVIDER);
+  recLevel = recUnits(c->level, (recConfig.trigger == REC_TRIG_I) ? pfCalibration.iscale : pfCalibration.uscale);
+  recPre = min((uint32_t)REC_SAMPLES * recConfig.pre / 100, REC_SAMPLES - 1);
+  recPos = recFill = recSkip = 0;
+  recPrev = 0;
+  recStatus = REC_ARMED;
+  __enable_irq();
+  return true;
+}
+
+// drop the snapshot and give the buffer back to the FFT
+void recStop(void)
+{
+  if (recStatus != REC_OFF) {
+    recStatus = REC_OFF;
+    fftRelease();
+  }
+}
+
+uint8_t recState(void)
+{
+  return recStatus;
+}
+
+// from the ADC interrupt
+static void recFire(uint8_t cause)
+{
+  if ((recStatus != REC_ARMED) || (recFill < recPre + 1)) {
+    return;
+  }
+  recInfo.time = millis();
+  recInfo.sampleTime = adcGetSampleTime() * recConfig.divider;
+  recInfo.pre = recPre;
+  recInfo.cause = cause;
+  recRemain = REC_SAMPLES - recPre - 1;
+  recStatus = recRemain ? REC_POST : REC_FROZEN;
+}
+
+// triggers from elsewhere in the engine, fires if the cause was selected
+void recTrigger(uint8_t cause)
+{
+  if (cause == recConfig.trigger) {
+    recFire(cause);
+  }
+}
+
+// manual trigger from the main loop
+void recForce(void)
+{
+  __disable_irq();
+  recFire(REC_TRIG_MANUAL);
+  __enable_irq();
+}
+
+// called for every sample from the ADC interrupt
+void recSample(int16_t u, int16_t i)
+{
+  int16_t x;
+
+  if ((recStatus != REC_ARMED) && (recStatus != REC_POST)) {
+    return;
+  }
+  if (++recSkip < recConfig.divider) {
+    return;
+  }
+  recSkip = 0;
+
+  recRing[recPos] = (uint16_t)u | ((uint32_t)(uint16_t)i << 16);
+  recPos = (recPos + 1) & (REC_SAMPLES - 1);
+  if (recFill < REC_SAMPLES) {
+    recFill++;
+  }
+
+  if (recStatus == REC_POST) {
+    if (!--recRemain) {
+      recStatus = REC_FROZEN;
+    }
+    return;
+  }
+
+  if ((recConfig.trigger != REC_TRIG_U) && (recConfig.trigger != REC_TRIG_I)) {
+    return;
+  }
+  x = (recConfig.trigger == REC_TRIG_I) ? i : u;
+  if ((recConfig.slope != REC_FALLING) && (recPrev < recLevel) && (x >= recLevel)) {
+    recFire(recConfig.trigger);
+  } else if ((recConfig.slope != REC_RISING) && (recPrev > recLevel) && (x <= recLevel)) {
+    recFire(recConfig.trigger);
+  }
+  recPrev = x;
+}
+
+static uint8_t  recSum1, recSum2;
+static uint16_t recOut;
+
+static void recByte(uint8_t b)
+{
+  uartWrite(b);
+  recSum1 = (recSum1 + b) % 255;
+  recSum2 = (recSum2 + recSum1) % 255;
+  // the transmit ring is 256 bytes and never blocks
+  if (!(++recOut & 0x7f)) {
+    while (!uartTransmitEmpty());
+  }
+}
+
+static void recWord(uint32_t w, uint8_t bytes)
+{
+  while (bytes--) {
+    recByte(w);
+    w >>= 8;
+  }
+}
+
+void recDump(void)
+{
+  uint16_t n;
+
+  if (recStatus != REC_FROZEN) {
+    printf("no snapshot\n");
+    return;
+  }
+  recOut = 0;
+  recByte('W');
+  recByte('F');
+  recSum1 = recSum2 = 0;
+  recWord(REC_VERSION, 1);
+  recWord(recInfo.cause, 1);
+  recWord(REC_SAMPLES, 2);
+  recWord(recInfo.pre, 2);
+  recWord(recInfo.sampleTime, 4);
+  recWord(pfCalibration.uscale, 4);
+  recWord(pfCalibration.iscale, 4);
+  recWord(recInfo.time, 4);
+  for (n = 0; n < REC_SAMPLES; n++) {
+    recWord(recRing[(recPos + n) & (REC_SAMPLES - 1)], 4);
+  }
+  recWord(((uint16_t)recSum2 << 8) | recSum1, 2);
+  while (!uartTransmitEmpty());
+}
+
+void recReport(void)
+{
+  static const char *state[] = { "off", "armed", "triggered", "frozen" };
+  static const char *trigger[REC_TRIGGERS] = { "manual", "U", "I", "event" };
+
+  printf("recorder %s trigger %s level %d slope %d pre %d%% divider %d\n",
+         state[recStatus], trigger[recConfig.trigger], recConfig.level, recConfig.slope,
+         recConfig.pre, recConfig.divider);
+  if (recStatus == REC_FROZEN) {
+    printf("snapshot %d samples, %d before the %s trigger at %u ms, %u ps apart\n",
+           REC_SAMPLES, recInfo.pre, trigger[recInfo.cause], recInfo.time, recInfo.sampleTime);
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+// Transient recorder: while armed, every sample pair (or every nth) goes
+// into a ring, a trigger freezes it once the post trigger part is in. The
+// ring borrows the FFT buffer, so recording and spectra take turns.
+#define REC_SAMPLES      (2 * FFT_POINTS)   // a packed U/I word each, 4KB
+#define REC_MAX_DIVIDER  8
+
+enum {
+  REC_TRIG_MANUAL = 0,  // recForce() only
+  REC_TRIG_U,           // U crosses the level
+  REC_TRIG_I,           // I crosses the level, e.g. overcurrent
+  REC_TRIG_EVENT,       // Urms(1/2) leaves the event thresholds, see events.h
+  REC_TRIGGERS
+};
+
+enum {
+  REC_EITHER = 0,
+  REC_RISING,
+  REC_FALLING
+};
+
+enum {
+  REC_OFF = 0,
+  REC_ARMED,
+  REC_POST,             // triggered, filling the post trigger part
+  REC_FROZEN            // snapshot complete, see recDump()
+};
+
+struct recConfig {
+  uint8_t trigger;      // REC_TRIG_*
+  uint8_t slope;        // REC_EITHER, REC_RISING or REC_FALLING
+  int32_t level;        // mV for U, uA for I
+  uint8_t pre;          // % of the snapshot before the trigger
+  uint8_t divider;      // keep every nth sample, 1..REC_MAX_DIVIDER
+};
+
+// describes a frozen snapshot
+struct recInfo {
+  uint32_t time;        // millis() at the trigger
+  uint32_t sampleTime;  // ps between stored samples
+  uint16_t pre;         // samples before the trigger sample
+  uint8_t  cause;       // REC_TRIG_* that fired
+};
+
+extern struct recConfig recConfig;
+extern struct recInfo recInfo;
+
+bool recArm(const struct recConfig *c);
+void recStop(void);
+void recSample(int16_t u, int16_t i);
+void recTrigger(uint8_t cause);
+void recForce(void);
+uint8_t recState(void);
+void recDump(void);
+void recReport(void);
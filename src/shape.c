@@ -0,0 +1,121 @@
+#include "board.h"
+
+/*
+    shapeCycle() runs from the ADC interrupt at every crossing, the ratios
+    come straight from the sample unit sums so only DC needs a scale. The
+    instantaneous extremes are held in sample units and scaled when read.
+    Cycles far off a mains cycle (no crossings for a while, a crossing
+    right after another) are left out of the values and the holds.
+*/
+
+static struct shapeResults shapeData;
+static int16_t shapeMinU, shapeMaxU, shapeMinI, shapeMaxI;
+
+void shapeStart(struct shapeSums *c)
+{
+  memset(c, 0, sizeof(*c));
+  c->minU = c->minI = INT16_MAX;
+  c->maxU = c->maxI = INT16_MIN;
+}
+
+static void shapeHold(struct shapeValue *v, int32_t x)
+{
+  v->last = x;
+  if (!shapeData.cycles) {
+    v->min = v->max = x;
+  } else {
+    v->min = min(v->min, x);
+    v->max = max(v->max, x);
+  }
+}
+
+static void shapeChannel(int64_t sum, int64_t sumAbs, int64_t sum2, int16_t lo, int16_t hi,
+                         uint32_t n, int16_t offset, uint32_t scale, struct shapeValue *crest,
+                         struct shapeValue *form, struct shapeValue *dc, struct shapeValue *asym)
+{
+  uint32_t rms = isqrt64(fixMean(sum2, n, 16));     // Q8
+  uint32_t mean = fixMean(sumAbs, n, 8);            // Q8
+  int32_t peak = max(hi, -lo);
+
+  shapeHold(crest, rms ? ((int64_t)peak * 256000 + rms / 2) / rms : 0);
+  shapeHold(form, mean ? ((uint64_t)rms * 1000 + mean / 2) / mean : 0);
+  shapeHold(dc, (fixMulQ16(fixMean(sum, n, 8) + (int32_t)offset * 256, scale) + 128) >> 8);
+  shapeHold(asym, (hi > lo) ? ((int32_t)hi + lo) * 1000 / ((int32_t)hi - lo) : 0);
+}
+
+// called from the ADC interrupt with the sums of every completed cycle and
+// the tracked offsets less the calibrated ones, in sample units
+void shapeCycle(const struct shapeSums *c, const struct pfSums *s, const int16_t offset[2])
+{
+  uint32_t n = s->samples;
+
+  if ((n < PLL_SAMPLES / 2) || (n > 2 * PLL_SAMPLES)) {
+    return;
+  }
+  shapeChannel(c->sumU, c->sumAbsU, s->sumU2, c->minU, c->maxU, n, offset[0], pfCalibration.uscale,
+               &shapeData.crestU, &shapeData.formU, &shapeData.dcU, &shapeData.asymU);
+  shapeChannel(c->sumI, c->sumAbsI, s->sumI2, c->minI, c->maxI, n, offset[1], pfCalibration.iscale,
+               &shapeData.crestI, &shapeData.formI, &shapeData.dcI, &shapeData.asymI);
+  if (!shapeData.cycles) {
+    shapeMinU = c->minU;
+    shapeMaxU = c->maxU;
+    shapeMinI = c->minI;
+    shapeMaxI = c->maxI;
+  } else {
+    shapeMinU = min(shapeMinU, c->minU);
+    shapeMaxU = max(shapeMaxU, c->maxU);
+    shapeMinI = min(shapeMinI, c->minI);
+    shapeMaxI = max(shapeMaxI, c->maxI);
+  }
+  shapeData.cycles++;
+}
+
+// clears the holds, the next cycle starts them again
+void shapeReset(void)
+{
+  __disable_irq();
+  shapeData.cycles = 0;
+  __enable_irq();
+}
+
+void shapeGet(struct shapeResults *r)
+{
+  int16_t lo[2], hi[2];
+
+  __disable_irq();
+  *r = shapeData;
+  lo[0] = shapeMinU;
+  hi[0] = shapeMaxU;
+  lo[1] = shapeMinI;
+  hi[1] = shapeMaxI;
+  __enable_irq();
+  r->minU = fixMulQ16(lo[0], pfCalibration.uscale);
+  r->maxU = fixMulQ16(hi[0], pfCalibration.uscale);
+  r->minI = fixMulQ16(lo[1], pfCalibration.iscale);
+  r->maxI = fixMulQ16(hi[1], pfCalibration.iscale);
+}
+
+static void shapeLine(const char *name, const struct shapeValue *v)
+{
+  printf("%s %d %d %d\n", name, v->last, v->min, v->max);
+}
+
+void shapeReport(void)
+{
+  struct shapeResults r;
+
+  shapeGet(&r);
+  printf("shape of %u cycles: last min max\n", r.cycles);
+  if (!r.cycles) {
+    return;
+  }
+  shapeLine("crest_U_m", &r.crestU);
+  shapeLine("crest_I_m", &r.crestI);
+  shapeLine("form_U_m", &r.formU);
+  shapeLine("form_I_m", &r.formI);
+  shapeLine("dc_U_mV", &r.dcU);
+  shapeLine("dc_I_uA", &r.dcI);
+  shapeLine("asym_U_m", &r.asymU);
+  shapeLine("asym_I_m", &r.asymI);
+  printf("held U %d..%d mV I %d..%d uA\n", r.minU, r.maxU, r.minI, r.maxI);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+// Per cycle waveform shape of U and I: crest factor (peak / RMS), form
+// factor (RMS / rectified mean), DC and peak asymmetry ((max + min) /
+// (max - min)). The engine adds the shape sums in the same pass as the
+// window sums and hands them over at every crossing with the cycle's
+// pfSums. Each value keeps its last cycle and min/max hold registers
+// that run across windows until shapeReset().
+//
+// The samples come with the tracked offset removed, which settles the
+// mean of every cycle to zero, so DC is taken against the calibrated
+// offset instead: the tracked offset less pfCalibration.offset plus the
+// residual mean. It is the signal's DC plus any drift of the front end
+// since the offsets were captured ('C').
+
+// sums of one cycle, besides the squares in struct pfSums
+struct shapeSums {
+  int64_t  sumU, sumI;          // for DC
+  int64_t  sumAbsU, sumAbsI;    // for the rectified mean
+  int16_t  minU, maxU, minI, maxI;
+};
+
+struct shapeValue {
+  int32_t last, min, max;
+};
+
+struct shapeResults {
+  struct shapeValue crestU, crestI;   // 0.001
+  struct shapeValue formU, formI;     // 0.001
+  struct shapeValue dcU, dcI;         // mV, uA
+  struct shapeValue asymU, asymI;     // 0.001, positive if the positive peak is higher
+  int32_t minU, maxU, minI, maxI;     // mV, uA, instantaneous extremes held
+  uint32_t cycles;                    // since the reset
+};
+
+void shapeStart(struct shapeSums *c);
+void shapeCycle(const struct shapeSums *c, const struct pfSums *s, const int16_t offset[2]);
+void shapeReset(void);
+void shapeGet(struct shapeResults *r);
+void shapeReport(void);
@@ -0,0 +1,133 @@
+#include "board.h"
+
+/*
+    The ring holds the sums of the last slideCycles cycles and their
+    lengths. Sums are integers, adding a cycle and later subtracting the
+    same cycle leaves no residue however long the ring runs. Everything
+    up to the copy in slideWait() runs from the ADC interrupt, once per
+    cycle and not per sample.
+*/
+
+struct slideEntry {
+  struct pfSums s;
+  uint32_t time;        // ns, 0 if the cycle was not timed
+};
+
+struct slideResults slideResults;
+uint16_t slideLost;                       // results never read
+
+static struct slideEntry slideRing[SLIDE_MAX_CYCLES];
+static struct pfSums slideSum;            // of the cycles in the ring
+static uint64_t slideTime;                // ns, of the timed cycles
+static uint8_t  slideTimed;
+static uint8_t  slideCycles;              // ring length, 0 disabled
+static uint8_t  slidePos, slideFill;
+static volatile uint16_t slideSeq;        // results completed
+static uint16_t slideLastSeq;
+
+static void slideAdd(struct pfSums *a, const struct pfSums *b, int8_t sign)
+{
+  a->sumU2 += sign * b->sumU2;
+  a->sumI2 += sign * b->sumI2;
+  a->sumUI += sign * b->sumUI;
+  a->sumUqI += sign * b->sumUqI;
+  a->samples += sign * (int32_t)b->samples;
+}
+
+// empty the ring, the next result comes after n new cycles
+void slideReset(void)
+{
+  memset(&slideSum, 0, sizeof(slideSum));
+  slideTime = 0;
+  slideTimed = 0;
+  slidePos = slideFill = 0;
+  slideLastSeq = slideSeq;
+}
+
+// 0 turns the sliding results off, anything above SLIDE_MAX_CYCLES is
+// limited to it
+void slideSetCycles(uint16_t n)
+{
+  __disable_irq();
+  slideCycles = min(n, SLIDE_MAX_CYCLES);
+  slideReset();
+  __enable_irq();
+}
+
+uint8_t slideGetCycles(void)
+{
+  return slideCycles;
+}
+
+// called from the ADC interrupt with the sums of every completed cycle
+void slideCycle(const struct pfSums *s, uint32_t ns)
+{
+  struct slideEntry *e = &slideRing[slidePos];
+
+  if (!slideCycles) {
+    return;
+  }
+  if (slideFill == slideCycles) {
+    slideAdd(&slideSum, &e->s, -1);
+    if (e->time) {
+      slideTime -= e->time;
+      slideTimed--;
+    }
+  } else {
+    slideFill++;
+  }
+  e->s = *s;
+  e->time = ns;
+  slideAdd(&slideSum, s, 1);
+  if (ns) {
+    slideTime += ns;
+    slideTimed++;
+  }
+  if (++slidePos >= slideCycles) {
+    slidePos = 0;
+  }
+  if (slideFill == slideCycles) {
+    slideSeq++;
+  }
+}
+
+// returns 1 when a new result is in slideResults
+uint8_t slideWait(void)
+{
+  struct pfSums s;
+  uint64_t time;
+  uint16_t seq;
+  uint8_t timed, cycles;
+
+  if (slideSeq == slideLastSeq) {
+    return 0;
+  }
+
+  __disable_irq();
+  s = slideSum;
+  time = slideTime;
+  timed = slideTimed;
+  cycles = slideFill;
+  seq = slideSeq;
+  __enable_irq();
+  slideLost += seq - slideLastSeq - 1;
+  slideLastSeq = seq;
+
+  if (!s.samples) {
+    return 0;
+  }
+  pfSumsToPower(&s, &slideResults.power);
+  slideResults.frequency = (timed == cycles) ? (1000000000000ULL * timed + time / 2) / time : 0;
+  slideResults.samples = s.samples;
+  slideResults.cycles = cycles;
+  return 1;
+}
+
+// one line per result: Urms_mV Irms_uA P_mW Q_mvar S_mVA PF_m f_mHz
+void slideReport(void)
+{
+  struct pfPower *p = &slideResults.power;
+
+  printf("L %d %d %d %d %d %d %u\n", p->Urms, p->Irms, p->powerW, p->powerVAR,
+         p->powerVA, p->powerFactor, slideResults.frequency);
+}
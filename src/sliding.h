@@ -0,0 +1,24 @@
+#pragma once
+
+// N cycle sliding RMS and power, a new result at the end of every mains
+// cycle. The engine hands over the sums of each completed cycle, a ring
+// keeps the last N of them and the total is updated by adding the newest
+// and dropping the oldest, so the cost is the same whatever N is.
+#define SLIDE_MAX_CYCLES 32
+
+struct slideResults {
+  struct pfPower power;
+  uint32_t frequency;   // mHz, 0 if a cycle in the ring was not timed
+  uint32_t samples;
+  uint8_t  cycles;
+};
+
+extern struct slideResults slideResults;
+extern uint16_t slideLost;
+
+void slideSetCycles(uint16_t n);
+uint8_t slideGetCycles(void);
+void slideReset(void);
+void slideCycle(const struct pfSums *s, uint32_t ns);
+uint8_t slideWait(void);
+void slideReport(void);
@@ -0,0 +1,708 @@
+/*
+    Host simulation of the measurement engine.
+
+    powerfactor.c is built natively against stand-ins for the ADC driver
+    and the system timer. Samples are generated (fundamental, harmonics,
+    noise, frequency drift, sags) or replayed from a file and fed in DMA
+    sized blocks through handleBlockFromADC(), as fast as the host allows.
+    Simulated time advances with the ADC trigger period, so the mains
+    synchronous sampling loop sees the same feedback as on the target.
+
+    Each result (a window unless -e is given) is printed next to the values of the generated
+    signal, followed by the worst errors and the engine cost per sample.
+
+    Replay files are text, one "u i" pair per line in signed 16 bit sample
+    units (what handleValuesFromADC() gets). They are replayed at the rate
+    given with -r, the trigger period set by the engine is ignored.
+*/
+
+#include "board.h"
+#include <getopt.h>
+#include <time.h>
+
+#undef printf
+#undef sprintf
+
+#define MAX_HARMONICS 8
+
+// engine results are integers: mV, uA, mW, mVA, 0.001 and mHz
+#define SIM_V(x)  ((x) / 1e3)
+#define SIM_A(x)  ((x) / 1e6)
+#define SIM_W(x)  ((x) / 1e3)
+#define SIM_PF(x) ((x) / 1e3)
+#define SIM_HZ(x) ((x) / 1e3)
+#define SIM_ENERGY(r) (energy[r].milli / 1e3 + energy[r].pico / 3.6e15)
+
+static double   uRms = 230.0, iRms = 5.0, phase = 0.0;
+static double   skew = 0.0;       // extra lag of the current chain, not part of the signal
+static int      correction = 0;
+static double   freq = 50.0, drift = 0.0;
+static double   noise = 0.0;
+static int      offsetU = 0, offsetI = 0;
+static double   sagStart = -1, sagLength = 0, sagDepth = 0;
+static double   inrushStart = -1, inrushFactor = 1, inrushTau = 0;
+static double   inrushI2t = 0;    // A2s of the generated current while recorded
+static double   modFreq = 0, modDepth = 0;  // flicker: Hz and dU/U max to min
+static bool     modRect = false;
+static int      harmonics = 0;
+static int      hOrder[MAX_HARMONICS];
+static double   hU[MAX_HARMONICS], hI[MAX_HARMONICS];
+static int      windows = 20;
+static double   maxTime = 600;    // simulated seconds, windows never end without mains
+static bool     quiet = false;
+static bool     analysis = false; // print the harmonics of every window, shape and histograms at the end
+static int      spectrum = -1;    // channel for the FFT at the end, -1 none
+static struct pfConfig config = { 0, 0, 0, PF_AVG_NONE };
+static int      sliding = 0;      // cycles of the sliding results, 0 off
+static FILE    *replay = NULL;
+static FILE    *waveform = NULL;  // recorder snapshot, armed on events
+static uint32_t replayRate = ADC_SAMPLE_RATE;
+
+/*
+    ADC driver and timer stand-ins
+*/
+
+static void (*simHandler)(volatile uint32_t *, uint16_t) = NULL;
+static uint32_t simPeriod;        // timer ticks per sample, 24.8 fixed point
+static uint32_t simRate;
+static uint32_t simBlockTime;     // ps per sample of the block being handled
+static uint8_t  simDecimation;
+static double   simTime = 0;      // seconds
+
+void adcInit(void (*h)(volatile uint32_t *, uint16_t))
+{
+  simHandler = h;
+  adcSetSampleRate(ADC_SAMPLE_RATE);
+}
+
+uint32_t adcSetSampleRate(uint32_t hz)
+{
+  if (hz) {
+    adcSetSamplePeriod(((uint64_t)SIM_TIMER_CLOCK << 8) / hz);
+  }
+  return simRate;
+}
+
+uint32_t adcGetSampleRate(void)
+{
+  return simRate;
+}
+
+uint32_t adcGetSampleTime(void)
+{
+  return simBlockTime;
+}
+
+void adcSetSamplePeriod(uint32_t period)
+{
+  simPeriod = period;
+  simRate = ((uint64_t)SIM_TIMER_CLOCK << 8) / period;
+}
+
+uint32_t adcGetSamplePeriod(void)
+{
+  return simPeriod;
+}
+
+void adcSetDecimation(uint8_t n)
+{
+  simDecimation = min(n, ADC_MAX_DECIMATION);
+}
+
+uint8_t adcGetDecimation(void)
+{
+  return simDecimation;
+}
+
+// UART reports from the engine go to stdout
+bool uartTransmitEmpty(void)
+{
+  return true;
+}
+
+// binary UART output is the recorder dump, see recDump()
+void uartWrite(uint8_t ch)
+{
+  if (waveform) {
+    fputc(ch, waveform);
+  }
+}
+
+// nothing is persisted, energy starts from zero
+bool flashLogLoad(uint32_t first, uint8_t pages, void *data, uint16_t size, uint16_t version)
+{
+  return false;
+}
+
+static bool simBlock(void);
+
+// a save stalls the target for a page erase, the blocks converted
+// meanwhile reach the engine while it is paused
+bool flashLogSave(uint32_t first, uint8_t pages, const void *data, uint16_t size, uint16_t version)
+{
+  double end = simTime + 0.02;
+
+  while ((simTime < end) && simBlock());
+  return true;
+}
+
+static void simPutc(void *p, char c)
+{
+  putchar(c);
+}
+
+uint32_t micros(void)
+{
+  return (uint32_t)(simTime * 1e6);
+}
+
+uint32_t millis(void)
+{
+  return (uint32_t)(simTime * 1e3);
+}
+
+/*
+    Signal generation
+*/
+
+static double gauss(void)
+{
+  double a = (rand() + 1.0) / (RAND_MAX + 2.0);
+  double b = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return sqrt(-2.0 * log(a)) * cos(2.0 * M_PI * b);
+}
+
+static uint16_t quantize(double v, double scale, int offset)
+{
+  long code = lround(v / scale + noise * gauss()) + offset + 0x8000;
+  return constrain(code, 0, 0xffff);
+}
+
+// true values of the generated signal at the current time
+static double simAmplitude(void)
+{
+  if ((simTime >= sagStart) && (simTime < sagStart + sagLength)) {
+    return 1.0 - sagDepth;
+  }
+  return 1.0;
+}
+
+// current relative to iRms: off before the switch-on, then decaying from
+// inrushFactor with inrushTau, 1 once it is down to 0.01% above
+static double simInrush(void)
+{
+  double t = simTime - inrushStart;
+
+  if ((inrushStart < 0) || (t > inrushTau * log((inrushFactor - 1) * 1e4))) {
+    return 1.0;
+  }
+  return (t < 0) ? 0.0 : 1.0 + (inrushFactor - 1) * exp(-t / inrushTau);
+}
+
+// THD of the generated signal in percent, orders the engine covers
+static void simExpectedThd(double *tU, double *tI)
+{
+  double u2 = 0, i2 = 0;
+  int n;
+
+  for (n = 0; n < harmonics; n++) {
+    if (hOrder[n] >= 2 && hOrder[n] <= HRM_ORDERS) {
+      u2 += hU[n] * hU[n];
+      i2 += hI[n] * hI[n];
+    }
+  }
+  *tU = sqrt(u2) * 100;
+  *tI = sqrt(i2) * 100;
+}
+
+// quadrature Q (U delayed by a quarter cycle shifts order n by n x 90
+// degrees) and fundamental Q1 of the generated signal
+static void simExpectedQ(double *eQ, double *eQ1)
+{
+  double amp = uRms * simAmplitude() * iRms;
+  int n;
+
+  *eQ1 = amp * sin(phase);
+  *eQ = *eQ1;
+  for (n = 0; n < harmonics; n++) {
+    *eQ += amp * hU[n] * hI[n] * cos(hOrder[n] * (phase - M_PI / 2));
+  }
+}
+
+static void simExpected(double *eU, double *eI, double *eP, double *eF)
+{
+  double u2 = 1.0, i2 = 1.0, ui = cos(phase);
+  int n;
+
+  for (n = 0; n < harmonics; n++) {
+    u2 += hU[n] * hU[n];
+    i2 += hI[n] * hI[n];
+    ui += hU[n] * hI[n] * cos(hOrder[n] * phase);
+  }
+  *eU = uRms * simAmplitude() * sqrt(u2);
+  *eI = iRms * sqrt(i2);
+  *eP = uRms * simAmplitude() * iRms * ui;
+  *eF = freq + drift * simTime;
+}
+
+static bool simSample(uint32_t *word)
+{
+  static double theta = 0, flick = 0;
+  double dt, u, i, f, amp = simAmplitude(), iamp = simInrush();
+  int n;
+
+  if (replay) {
+    int ru, ri;
+    if (fscanf(replay, "%d %d", &ru, &ri) != 2) {
+      return false;
+    }
+    ru = constrain(ru, -0x8000, 0x7fff);
+    ri = constrain(ri, -0x8000, 0x7fff);
+    *word = (uint32_t)(ru + 0x8000) | ((uint32_t)(ri + 0x8000) << 16);
+    simTime += 1.0 / replayRate;
+    return true;
+  }
+
+  dt = (double)simPeriod / 256.0 / SIM_TIMER_CLOCK;
+  f = freq + drift * simTime;
+  u = sin(theta);
+  i = sin(theta - phase - skew);
+  for (n = 0; n < harmonics; n++) {
+    u += hU[n] * sin(hOrder[n] * theta);
+    i += hI[n] * sin(hOrder[n] * (theta - phase - skew));
+  }
+  u *= M_SQRT2 * uRms * amp;
+  if (modFreq > 0) {
+    double m = modRect ? ((sin(flick) >= 0) ? 1.0 : -1.0) : sin(flick);
+    u *= 1.0 + modDepth / 2 * m;
+  }
+  i *= M_SQRT2 * iRms * iamp;
+  if ((simTime >= inrushStart) && (simTime < inrushStart + inrConfig.ms / 1e3)) {
+    inrushI2t += i * i * dt;
+  }
+
+  *word = quantize(u, USCALE, offsetU) | ((uint32_t)quantize(i, ISCALE, offsetI) << 16);
+
+  theta += 2.0 * M_PI * f * dt;
+  flick = fmod(flick + 2.0 * M_PI * modFreq * dt, 2.0 * M_PI);
+  if (theta > 2.0 * M_PI) {
+    theta -= 2.0 * M_PI;
+  }
+  simTime += dt;
+  return true;
+}
+
+static double   engineTime = 0;   // host seconds spent in the engine
+static uint64_t engineSamples = 0;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// one DMA half buffer worth of decimated samples, false at end of replay
+static bool simBlock(void)
+{
+  static uint32_t block[ADC_BLOCK_SIZE];
+  uint16_t n, count = ADC_BLOCK_SIZE >> simDecimation;
+  double t;
+
+  // 1e12 / 256 ps per tick of the 24.8 period, replays have their own rate
+  simBlockTime = replay ? 1000000000000ULL / replayRate
+                 : (uint64_t)simPeriod * 3906250000ULL / SIM_TIMER_CLOCK;
+
+  for (n = 0; n < count; n++) {
+    if (!simSample(&block[n])) {
+      break;
+    }
+  }
+  if (n && simHandler) {
+    t = now();
+    simHandler(block, n);
+    engineTime += now() - t;
+    engineSamples += n;
+  }
+  return n == count;
+}
+
+/*
+    Command line
+*/
+
+static void simUsage(void)
+{
+  fprintf(stderr,
+          "usage: pfsim [-u Urms] [-i Irms] [-p phase_deg] [-f Hz] [-d Hz/s]\n"
+          "             [-k skew_deg] [-C correction_centideg]\n"
+          "             [-H order:u%%:i%%]... [-n noise_lsb] [-o uoff:ioff]\n"
+          "             [-s start:length:depth] [-j start:factor:tau] [-w results]\n"
+          "             [-M Hz:dU%%[:r]] [-t max_s] [-a] [-q]\n"
+          "             [-c cycles | -m window_ms] [-e refresh_ms] [-v averaging]\n"
+          "             [-l sliding_cycles]\n"
+          "             [-F channel] [-W snapshot_file]\n"
+          "             [-R file [-r rate]]\n");
+}
+
+static void simOptions(int argc, char **argv)
+{
+  int ch;
+
+  while ((ch = getopt(argc, argv, "u:i:p:k:C:f:d:H:n:o:s:w:t:c:m:e:v:j:M:l:aF:W:qR:r:h")) != -1) {
+    switch (ch) {
+    case 'u':
+      uRms = atof(optarg);
+      break;
+    case 'i':
+      iRms = atof(optarg);
+      break;
+    case 'p':
+      phase = atof(optarg) * M_PI / 180.0;
+      break;
+    case 'k':
+      skew = atof(optarg) * M_PI / 180.0;
+      break;
+    case 'C':
+      correction = atoi(optarg);
+      break;
+    case 'f':
+      freq = atof(optarg);
+      break;
+    case 'd':
+      drift = atof(optarg);
+      break;
+    case 'H':
+      if (harmonics < MAX_HARMONICS &&
+          sscanf(optarg, "%d:%lf:%lf", &hOrder[harmonics], &hU[harmonics], &hI[harmonics]) == 3) {
+        hU[harmonics] /= 100.0;
+        hI[harmonics] /= 100.0;
+        harmonics++;
+      }
+      break;
+    case 'n':
+      noise = atof(optarg);
+      break;
+    case 'o':
+      sscanf(optarg, "%d:%d", &offsetU, &offsetI);
+      break;
+    case 's':
+      sscanf(optarg, "%lf:%lf:%lf", &sagStart, &sagLength, &sagDepth);
+      break;
+    case 'j':
+      sscanf(optarg, "%lf:%lf:%lf", &inrushStart, &inrushFactor, &inrushTau);
+      inrushFactor = max(inrushFactor, 1.0);
+      inrushTau = max(inrushTau, 1e-3);
+      break;
+    case 'M': {
+      char shape = 0;
+      sscanf(optarg, "%lf:%lf:%c", &modFreq, &modDepth, &shape);
+      modDepth /= 100.0;
+      modRect = (shape == 'r');
+      break;
+    }
+    case 'w':
+      windows = atoi(optarg);
+      break;
+    case 't':
+      maxTime = atof(optarg);
+      break;
+    case 'c':
+      config.cycles = atoi(optarg);
+      break;
+    case 'm':
+      config.ms = atoi(optarg);
+      break;
+    case 'e':
+      config.refresh = atoi(optarg);
+      break;
+    case 'v':
+      config.averaging = atoi(optarg);
+      break;
+    case 'l':
+      sliding = atoi(optarg);
+      break;
+    case 'a':
+      analysis = true;
+      break;
+    case 'F':
+      spectrum = atoi(optarg);
+      break;
+    case 'W':
+      waveform = fopen(optarg, "wb");
+      if (!waveform) {
+        perror(optarg);
+        exit(1);
+      }
+      break;
+    case 'q':
+      quiet = true;
+      break;
+    case 'R':
+      replay = fopen(optarg, "r");
+      if (!replay) {
+        perror(optarg);
+        exit(1);
+      }
+      break;
+    case 'r':
+      replayRate = atoi(optarg);
+      break;
+    default:
+      simUsage();
+      exit(1);
+    }
+  }
+}
+
+static void simAggregates(uint8_t ready)
+{
+  static const char *name[AGG_LEVELS] = { "3s", "10min", "2h" };
+  uint8_t i;
+
+  for (i = 0; i < AGG_LEVELS; i++) {
+    struct aggResults *r = &aggResults[i];
+    if (quiet || !(ready & (1 << i))) {
+      continue;
+    }
+    printf("%8.3f %8.4f %8.2f %8.2f %6.3f %8.4f %8u  (%s)\n",
+           SIM_V(r->power.Urms), SIM_A(r->power.Irms), SIM_W(r->power.powerW),
+           SIM_W(r->power.powerVA), SIM_PF(r->power.powerFactor), SIM_HZ(r->frequency),
+           r->windows, name[i]);
+  }
+}
+
+// orders above 0.1% of the fundamental and the power decomposition
+static void simHarmonics(void)
+{
+  struct hrmResults *h = &hrmResults;
+  struct pfIEEE1459 *e = &pfResults.ieee;
+  int n;
+
+  printf("   Q %.2f var  P1 %.2f W  Q1 %.2f var  S1 %.2f VA  pf1 %.3f\n",
+         SIM_W(pfResults.power.powerVAR), SIM_W(e->P1), SIM_W(e->Q1), SIM_W(e->S1), SIM_PF(e->pf1));
+  printf("   U1 %.3f UH %.3f V  I1 %.4f IH %.4f A  SN %.2f DI %.2f DV %.2f SH %.2f VA  N %.2f D %.2f var\n",
+         SIM_V(e->U1), SIM_V(e->UH), SIM_A(e->I1), SIM_A(e->IH), SIM_W(e->SN), SIM_W(e->DI),
+         SIM_W(e->DV), SIM_W(e->SH), SIM_W(e->N), SIM_W(e->D));
+
+  printf("   cycles Hz");
+  for (n = 0; n < pfResults.timedCycles; n++) {
+    printf(" %.4f", SIM_HZ(pfResults.cycleFrequency[n]));
+  }
+  printf("\n");
+
+  printf("   THD U %.2f%%  I %.2f%%  %s\n", h->thdU / 100.0, h->thdI / 100.0,
+         h->valid ? "" : "(async)");
+  for (n = 0; n < HRM_ORDERS; n++) {
+    if (h->U[n] > h->U[0] / 1000 || h->I[n] > h->I[0] / 1000) {
+      printf("   %2d  U %8.3f %6.1f  I %8.4f %6.1f\n", n + 1,
+             SIM_V(h->U[n]), h->phaseU[n] / 10.0, SIM_A(h->I[n]), h->phaseI[n] / 10.0);
+    }
+  }
+}
+
+// Captures one block of U (0) or I (1), prints the bins above 0.1% of the
+// largest one and times the transform on a copy of the block.
+static void simSpectrum(void)
+{
+  static struct fftComplex block[FFT_POINTS];
+  // Q16 mV or uA per sample unit, amplitudes are in 1/16 sample units
+  double scale = spectrum ? SIM_A(pfCalibration.iscale / 65536.0 / 16) : SIM_V(pfCalibration.uscale / 65536.0 / 16);
+  uint32_t top = 0;
+  int k, runs = 1000;
+  double t;
+
+  fftRequest(spectrum);
+  while (!fftReady() && simBlock() && simTime < maxTime + 1);
+  if (!fftReady()) {
+    printf("\nno FFT block captured\n");
+    return;
+  }
+  memcpy(block, fftData, sizeof(block));
+  fftTransform(FFT_AUTO);
+  for (k = 0; k < FFT_BINS; k++) {
+    top = max(top, fftAmplitude(k));
+  }
+  printf("\nspectrum of %c, %u Hz sample rate, %s\n", spectrum ? 'I' : 'U',
+         adcGetSampleRate(), pllLocked ? "synchronous" : "asynchronous");
+  for (k = 0; k < FFT_BINS; k++) {
+    uint32_t a = fftAmplitude(k);
+    if (a * 1000 >= top) {
+      printf("%4d %8.1f Hz %10.4f pk %10.4f rms\n", k, (double)k * adcGetSampleRate() / FFT_SAMPLES,
+             a * scale, a * scale / M_SQRT2);
+    }
+  }
+
+  t = now();
+  for (k = 0; k < runs; k++) {
+    memcpy(fftData, block, sizeof(block));
+    fftTransform(FFT_RECT);
+  }
+  printf("fft: %d real points, %.1f us per transform\n", FFT_SAMPLES, (now() - t) * 1e6 / runs);
+}
+
+static double relErr(double measured, double expected)
+{
+  if (expected == 0.0) {
+    return fabs(measured);
+  }
+  return fabs(measured - expected) / fabs(expected);
+}
+
+int main(int argc, char **argv)
+{
+  double errU = 0, errI = 0, errP = 0, errF = 0;
+  double errThdU = 0, errThdI = 0;
+  double errQ = 0, errQ1 = 0;       // relative to S
+  double expWh = 0, expVarh = 0;    // signal energy over the windows read
+  double errSlide = 0;              // worst of Urms, Irms and P
+  int slides = 0;
+  bool covered;
+  int done = 0;
+  bool more = true;
+
+  simOptions(argc, argv);
+  // results cover every window unless windows are skipped between them
+  covered = !config.refresh || (config.averaging == PF_AVG_BLOCK);
+  init_printf(NULL, simPutc);
+  adcInit(handleBlockFromADC);
+  adcSetDecimation(ADC_DECIMATION);
+  pfSetPhaseCorrection(correction);
+
+  printf("    Urms     Irms        P        S     PF        f  samples  lock\n");
+  pfSetConfig(&config);
+  pfStartMeasure();
+  slideSetCycles(sliding);
+  if (inrushStart >= 0) {
+    // trigger at half the steady peak
+    struct inrConfig inr = { iRms * M_SQRT2 * 500, 3000, 10 };
+    inrArm(&inr);
+  }
+  if (waveform) {
+    // a quarter before the event, 8 cycles at 50 Hz in total
+    struct recConfig rec = { REC_TRIG_EVENT, REC_EITHER, 0, 25, 2 };
+    recArm(&rec);
+  }
+  while (more && (done < windows) && (simTime < maxTime)) {
+    uint8_t result;
+    more = simBlock();
+    result = pfWaitMeasure();
+    energyUpdate();
+    histUpdate();
+    flkWait();
+    if (slideWait()) {
+      double eU, eI, eP, eF;
+      simExpected(&eU, &eI, &eP, &eF);
+      slides++;
+      if (!replay && (done >= 2) && (simAmplitude() == 1.0) && (simInrush() == 1.0) && !modFreq) {
+        errSlide = max(errSlide, relErr(SIM_V(slideResults.power.Urms), eU));
+        errSlide = max(errSlide, relErr(SIM_A(slideResults.power.Irms), eI));
+        errSlide = max(errSlide, relErr(SIM_W(slideResults.power.powerW), eP));
+      }
+    }
+    if (!result) {
+      continue;
+    }
+    if (result == 1) {
+      double eU, eI, eP, eF;
+      simExpected(&eU, &eI, &eP, &eF);
+      if (!quiet) {
+        printf("%8.3f %8.4f %8.2f %8.2f %6.3f %8.4f %8u  %s%s\n",
+               SIM_V(pfResults.power.Urms), SIM_A(pfResults.power.Irms), SIM_W(pfResults.power.powerW),
+               SIM_W(pfResults.power.powerVA), SIM_PF(pfResults.power.powerFactor),
+               SIM_HZ(pfResults.frequency), pfResults.samples,
+               pllLocked ? "yes" : "no", pfResults.flagged ? " flagged" : "");
+        if (!replay) {
+          printf("%8.3f %8.4f %8.2f %8.2f %6.3f %8.4f           (signal)\n",
+                 eU, eI, eP, eU * eI, eP / (eU * eI), eF);
+        }
+        if (analysis) {
+          simHarmonics();
+        }
+      }
+      // the first windows run while the sampling loop is still pulling in
+      if (!replay && (done >= 2) && (simAmplitude() == 1.0) && (simInrush() == 1.0) && !modFreq) {
+        errU = max(errU, relErr(SIM_V(pfResults.power.Urms), eU));
+        errI = max(errI, relErr(SIM_A(pfResults.power.Irms), eI));
+        errP = max(errP, relErr(SIM_W(pfResults.power.powerW), eP));
+        // the window mean is the frequency half a window ago
+        errF = max(errF, relErr(SIM_HZ(pfResults.frequency), eF - drift * pfResults.time / 2e6));
+        if (pllLocked) {
+          double eQ, eQ1;
+          simExpectedQ(&eQ, &eQ1);
+          errQ = max(errQ, fabs(SIM_W(pfResults.power.powerVAR) - eQ) / (eU * eI));
+          errQ1 = max(errQ1, fabs(SIM_W(pfResults.ieee.Q1) - eQ1) / (eU * eI));
+        }
+        if (hrmResults.valid) {
+          double tU, tI;
+          simExpectedThd(&tU, &tI);
+          errThdU = max(errThdU, fabs(hrmResults.thdU / 100.0 - tU));
+          errThdI = max(errThdI, fabs(hrmResults.thdI / 100.0 - tI));
+        }
+      }
+      expWh += eP * pfResults.time / 3.6e9;
+      expVarh += uRms * simAmplitude() * iRms * sin(phase) * pfResults.time / 3.6e9;
+      done++;
+      simAggregates(aggregateReady());
+    } else {
+      printf("error %d\n", result);
+    }
+  }
+
+  if (spectrum >= 0) {
+    simSpectrum();
+  }
+
+  printf("\n%d results, %.1f s simulated, offset %d%% settled, %u windows lost\n",
+         done, simTime, pfOffsetState(), windowsLost);
+  printf("max error: Urms %.4f%%  Irms %.4f%%  P %.4f%%  f %.4f%%\n",
+         errU * 100, errI * 100, errP * 100, errF * 100);
+  if (covered) {
+    printf("energy: import %.4f export %.4f Wh (signal %.4f), lag %.4f lead %.4f varh (signal %.4f)\n",
+           SIM_ENERGY(ENERGY_IMPORT), SIM_ENERGY(ENERGY_EXPORT), expWh,
+           SIM_ENERGY(ENERGY_Q_LAG), SIM_ENERGY(ENERGY_Q_LEAD), expVarh);
+  } else {
+    printf("energy: import %.4f export %.4f Wh, lag %.4f lead %.4f varh\n",
+           SIM_ENERGY(ENERGY_IMPORT), SIM_ENERGY(ENERGY_EXPORT),
+           SIM_ENERGY(ENERGY_Q_LAG), SIM_ENERGY(ENERGY_Q_LEAD));
+  }
+  printf("max Q error: %.4f%%  Q1 %.4f%% of S\n", errQ * 100, errQ1 * 100);
+  printf("max THD error: U %.4f  I %.4f percentage points\n", errThdU, errThdI);
+  if (sagStart >= 0) {
+    printf("\nsignal: %s at %.0f ms for %.0f ms to %.0f mV\n", (sagDepth < 0) ? "swell" : "sag",
+           sagStart * 1e3, sagLength * 1e3, uRms * (1.0 - sagDepth) * 1e3);
+    evtReport();
+  }
+  if (inrushStart >= 0) {
+    inrWait();
+    printf("\nsignal: switch-on at %.0f ms, peak %.0f uA, settled within %d%% after %.0f ms, I2t %.3f A2s\n",
+           inrushStart * 1e3, iRms * M_SQRT2 * inrushFactor * 1e6, inrConfig.settle,
+           inrushTau * log((inrushFactor - 1) * 100 / inrConfig.settle) * 1e3, inrushI2t);
+    inrReport(false);
+  }
+  if (waveform) {
+    recReport();
+    recDump();
+    fclose(waveform);
+  }
+  if (analysis) {
+    // a sine has crest 1414, form 1111, DC 0 and asymmetry 0
+    printf("\n");
+    shapeReport();
+    histReport();
+  }
+  if (modFreq > 0) {
+    printf("\nsignal: %s fluctuation %.3f Hz, dU/U %.3f%%\n", modRect ? "rectangular" : "sinusoidal",
+           modFreq, modDepth * 100);
+    flkReport();
+  }
+  if (sliding) {
+    printf("sliding: %d results of %d cycles, %u lost, max error %.4f%%\n",
+           slides, slideGetCycles(), slideLost, errSlide * 100);
+  }
+  if (engineSamples) {
+    printf("engine: %.1f ns/sample, %.0fx real time\n",
+           engineTime * 1e9 / engineSamples, simTime / engineTime);
+  }
+  return 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+    Host stand-ins for the STM32 headers, pulled in by board.h when the
+    measurement engine is built with -DSIMULATOR. The driver prototypes in
+    src/ are kept, sim.c implements the ones the engine calls.
+*/
+
+#define __IO volatile
+
+#define __disable_irq()
+#define __enable_irq()
+
+// simulated timer clock for the ADC trigger, as TIM3 on the target
+#define SIM_TIMER_CLOCK 72000000